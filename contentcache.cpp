@@ -0,0 +1,102 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <cstring>
+#include <cstdint>
+
+#include "contentcache.h"
+
+
+ContentCache::ContentCache(size_t max_bytes)
+	: max_bytes_(max_bytes)
+{
+	std::memset(&stats_, 0, sizeof(stats_));
+}
+
+ContentCache::~ContentCache()
+{
+}
+
+ContentCache::content_ptr ContentCache::find(const void *owner, uint64_t offset)
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	auto it = entries_.find(key_t(owner, offset));
+	if (it == entries_.end()) {
+		stats_.misses++;
+		return nullptr;
+	}
+	lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+	stats_.hits++;
+	return it->second.data;
+}
+
+ContentCache::content_ptr ContentCache::insert(const void *owner, uint64_t offset, const content_ptr &data)
+{
+	if (data->size() > max_bytes_) {
+		return data;
+	}
+
+	std::lock_guard<std::mutex> guard(lock_);
+	key_t key(owner, offset);
+	auto it = entries_.find(key);
+	if (it != entries_.end()) {
+		lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+		return it->second.data;
+	}
+	lru_.push_front(key);
+	entry &ent = entries_[key];
+	ent.data = data;
+	ent.lru_pos = lru_.begin();
+	stats_.entries++;
+	stats_.bytes_cached += data->size();
+	evict_locked();
+	return data;
+}
+
+void ContentCache::evict_locked()
+{
+	// The newest entry fits on its own, so this stops before reaching it.
+	while (stats_.bytes_cached > max_bytes_) {
+		auto it = entries_.find(lru_.back());
+		stats_.bytes_cached -= it->second.data->size();
+		stats_.entries--;
+		stats_.evictions++;
+		entries_.erase(it);
+		lru_.pop_back();
+	}
+}
+
+void ContentCache::forget(const void *owner)
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	auto first = entries_.lower_bound(key_t(owner, 0));
+	auto it = first;
+	while (it != entries_.end() && it->first.first == owner) {
+		stats_.bytes_cached -= it->second.data->size();
+		stats_.entries--;
+		lru_.erase(it->second.lru_pos);
+		++it;
+	}
+	entries_.erase(first, it);
+}
+
+ContentCache::stats_t ContentCache::stats() const
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	return stats_;
+}
+
+void ContentCache::clear()
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	entries_.clear();
+	lru_.clear();
+	stats_.entries = 0;
+	stats_.bytes_cached = 0;
+}
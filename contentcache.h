@@ -0,0 +1,57 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+#pragma once
+
+// Bounded LRU cache of decoded pack entries.
+// Entries are keyed by an owner (the pack) and the entry's data offset.
+// Contents are handed out as shared pointers, so evicting an entry never
+// frees data that a reader still holds; it only stops counting against the
+// budget. Safe to share between threads and between packs.
+class ContentCache
+{
+public:
+	typedef std::shared_ptr<const std::vector<char>> content_ptr;
+
+	struct stats_t
+	{
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+		// Entries and decoded bytes currently held by the cache.
+		uint64_t entries;
+		uint64_t bytes_cached;
+	};
+
+public:
+	explicit ContentCache(size_t max_bytes);
+	~ContentCache();
+
+	// Returns the cached contents, or nullptr (counted as a miss).
+	content_ptr find(const void *owner, uint64_t offset);
+	// Caches `data' and returns it. If another thread inserted the same
+	// entry meanwhile, that copy is kept and returned instead. Data larger
+	// than the whole budget is returned without being cached.
+	content_ptr insert(const void *owner, uint64_t offset, const content_ptr &data);
+	// Drops every entry of `owner'.
+	void forget(const void *owner);
+	stats_t stats() const;
+	void clear();
+
+private:
+	typedef std::pair<const void *, uint64_t> key_t;
+	struct entry
+	{
+		content_ptr data;
+		std::list<key_t>::iterator lru_pos;
+	};
+
+	void evict_locked();
+
+private:
+	size_t max_bytes_;
+	mutable std::mutex lock_;
+	std::map<key_t, entry> entries_;
+	// Most recently used first.
+	std::list<key_t> lru_;
+	stats_t stats_;
+};
@@ -0,0 +1,169 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include <cstring>
+#include <cstdint>
+
+#include "mabipack.h"
+#include "dirtree.h"
+
+
+// Orders path components the way their entries are ordered in the folded
+// index, where every component is followed by a '/'.
+static int compare_component(const char *a, size_t alen, const char *b, size_t blen)
+{
+	size_t n = std::min(alen, blen);
+	int cmp = std::memcmp(a, b, n);
+	if (cmp != 0 || alen == blen) {
+		return cmp;
+	}
+	unsigned char ca = alen > n ? a[n] : '/';
+	unsigned char cb = blen > n ? b[n] : '/';
+	return (int)ca - (int)cb;
+}
+
+
+DirTree::DirTree()
+	: index_(nullptr)
+{
+}
+
+void DirTree::clear()
+{
+	index_ = nullptr;
+	std::vector<dir>().swap(dirs_);
+	std::vector<uint32_t>().swap(children_);
+}
+
+void DirTree::build(const PackIndex &index)
+{
+	clear();
+	index_ = &index;
+	const std::vector<uint32_t> &order = index.folded_order();
+
+	dir root;
+	std::memset(&root, 0, sizeof (root));
+	root.end = order.size();
+	dirs_.push_back(root);
+	// The directories that contain the current entry, from the root down.
+	std::vector<uint32_t> stack(1, 0);
+	for (size_t k = 0; k < order.size(); k++) {
+		const char *name = index.lower_name(order[k]);
+		PackIndex::value_type entry = index.at(order[k]);
+		size_t len = entry.first.size();
+
+		while (stack.size() > 1) {
+			dir &top = dirs_[stack.back()];
+			size_t plen = top.path_len;
+			if (plen < len && name[plen] == '/' && !std::memcmp(lower_path(stack.back()), name, plen)) {
+				break;
+			}
+			top.end = k;
+			stack.pop_back();
+		}
+
+		size_t p = stack.size() > 1 ? dirs_[stack.back()].path_len + 1 : 0;
+		const char *slash;
+		while ((slash = (const char *)std::memchr(name + p, '/', len - p)) != nullptr) {
+			dir d;
+			std::memset(&d, 0, sizeof (d));
+			d.parent = stack.back();
+			d.path_len = slash - name;
+			d.begin = k;
+			stack.push_back(dirs_.size());
+			dirs_.push_back(d);
+			p = d.path_len + 1;
+		}
+
+		dir &parent = dirs_[stack.back()];
+		parent.files++;
+		parent.size += entry.second.size_orig;
+	}
+	while (stack.size() > 1) {
+		dirs_[stack.back()].end = order.size();
+		stack.pop_back();
+	}
+
+	// Directories were created in folded order, so each one's children are
+	// already sorted; group them by parent.
+	for (size_t n = 1; n < dirs_.size(); n++) {
+		dirs_[dirs_[n].parent].child_count++;
+	}
+	uint32_t off = 0;
+	for (dir &d : dirs_) {
+		d.child_off = off;
+		off += d.child_count;
+		d.child_count = 0;
+		d.total_size = d.size;
+	}
+	children_.resize(off);
+	for (size_t n = 1; n < dirs_.size(); n++) {
+		dir &parent = dirs_[dirs_[n].parent];
+		children_[parent.child_off + parent.child_count++] = n;
+	}
+	// Parents come before their children.
+	for (size_t n = dirs_.size() - 1; n > 0; n--) {
+		dirs_[dirs_[n].parent].total_size += dirs_[n].total_size;
+	}
+}
+
+int DirTree::find(const char *path, size_t len) const
+{
+	if (dirs_.empty()) {
+		return -1;
+	}
+	std::string key(path, len);
+	for (char &c : key) {
+		c = PackIndex::fold_char(c);
+	}
+
+	uint32_t n = 0;
+	for (size_t p = 0; len > 0; ) {
+		size_t q = key.find('/', p);
+		if (q == std::string::npos) {
+			q = len;
+		}
+		const dir &d = dirs_[n];
+		size_t skip = n == 0 ? 0 : d.path_len + 1;
+		const uint32_t *first = children_.data() + d.child_off;
+		const uint32_t *last = first + d.child_count;
+		const uint32_t *it = std::lower_bound(first, last, 0, [&](uint32_t child, int) {
+			return compare_component(lower_path(child) + skip, dirs_[child].path_len - skip, key.data() + p, q - p) < 0;
+		});
+		if (it == last || compare_component(lower_path(*it) + skip, dirs_[*it].path_len - skip, key.data() + p, q - p) != 0) {
+			return -1;
+		}
+		n = *it;
+		if (q == len) {
+			break;
+		}
+		p = q + 1;
+	}
+	return n;
+}
+
+const char *DirTree::lower_path(uint32_t n) const
+{
+	return index_->lower_name(index_->folded_order()[dirs_[n].begin]);
+}
+
+const char *DirTree::path(uint32_t n) const
+{
+	if (n == 0) {
+		return "";
+	}
+	return index_->at(index_->folded_order()[dirs_[n].begin]).first.data();
+}
+
+size_t DirTree::memory_usage() const
+{
+	return dirs_.capacity() * sizeof (dir) + children_.capacity() * sizeof (uint32_t);
+}
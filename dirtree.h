@@ -0,0 +1,60 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+#pragma once
+
+// Directory tree of a folded PackIndex.
+// Names are '/' separated and compared case insensitively, like patterns.
+// Every directory covers one contiguous range of the index's folded_order(),
+// so the entries below a directory, and their count and total size, are
+// found without looking at the rest of the pack. Directory 0 is the root.
+class DirTree
+{
+public:
+	struct dir
+	{
+		uint32_t parent;
+		// Length of the directory's path, without a trailing '/'.
+		uint32_t path_len;
+		// Subdirectories are children()[child_off, child_off + child_count).
+		uint32_t child_off;
+		uint32_t child_count;
+		// Entries below the directory, recursively, are
+		// folded_order()[begin, end).
+		uint32_t begin;
+		uint32_t end;
+		// Files directly in the directory.
+		uint32_t files;
+		uint64_t size;
+		// size of the directory and all its subdirectories.
+		uint64_t total_size;
+	};
+
+public:
+	DirTree();
+
+	void clear();
+	// Builds the tree of `index', which must be folded and must outlive it.
+	void build(const PackIndex &index);
+	bool empty() const { return dirs_.empty(); }
+
+	// Returns the directory number of `path' (no trailing '/', "" for the
+	// root), or -1 if no entry is below it.
+	int find(const char *path, size_t len) const;
+	const dir &at(uint32_t n) const { return dirs_[n]; }
+	size_t size() const { return dirs_.size(); }
+	const std::vector<uint32_t> &children() const { return children_; }
+	// Path of directory `n' as spelled by its first entry; path_len bytes
+	// long and not null terminated at that length.
+	const char *path(uint32_t n) const;
+
+	// Bytes of heap memory held by the tree.
+	size_t memory_usage() const;
+
+private:
+	const char *lower_path(uint32_t n) const;
+
+private:
+	const PackIndex *index_;
+	std::vector<dir> dirs_;
+	std::vector<uint32_t> children_;
+};
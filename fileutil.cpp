@@ -0,0 +1,85 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "mabipack.h"
+#include "fileutil.h"
+
+
+int write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	while (len > 0) {
+		ssize_t nwrite = ::write(fd, p, len);
+		if (nwrite < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nwrite <= 0) {
+			if (nwrite == 0) {
+				errno = EIO;
+			}
+			return -1;
+		}
+		p += nwrite;
+		len -= nwrite;
+	}
+	return 0;
+}
+
+
+ReplaceFile::ReplaceFile()
+	: fd_(-1)
+{
+}
+
+ReplaceFile::~ReplaceFile()
+{
+	discard();
+}
+
+int ReplaceFile::open(const std::string &path)
+{
+	discard();
+
+	char suffix[32];
+	snprintf(suffix, sizeof (suffix), ".tmp%d", (int)getpid());
+	path_ = path;
+	tmppath_ = path + suffix;
+	fd_ = ::open(tmppath_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	return fd_ < 0 ? -1 : 0;
+}
+
+int ReplaceFile::commit()
+{
+	int fd = fd_;
+	fd_ = -1;
+	if (::close(fd) < 0 || ::rename(tmppath_.c_str(), path_.c_str()) < 0) {
+		PreserveErrno pe;
+		::unlink(tmppath_.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+void ReplaceFile::discard()
+{
+	if (fd_ >= 0) {
+		PreserveErrno pe;
+		::close(fd_);
+		::unlink(tmppath_.c_str());
+		fd_ = -1;
+	}
+}
@@ -0,0 +1,31 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+#pragma once
+
+// Writes all of `len' bytes, retrying short writes and EINTR.
+// Returns <0 on error and errno is set appropriately.
+int write_full(int fd, const void *buf, size_t len);
+
+// A file written under a temporary name (<path>.tmp<pid>) and renamed over
+// `path' once complete, so that readers never see a partial file.
+// The temporary file is removed unless commit() succeeds.
+class ReplaceFile
+{
+public:
+	ReplaceFile();
+	~ReplaceFile();
+
+	// Creates the temporary file. Returns <0 on error and errno is set appropriately.
+	int open(const std::string &path);
+	int fd() const { return fd_; }
+	// Closes the temporary file and renames it to the path given to open().
+	// Returns <0 on error and errno is set appropriately.
+	int commit();
+	// Closes and removes the temporary file.
+	void discard();
+
+private:
+	int fd_;
+	std::string path_;
+	std::string tmppath_;
+};
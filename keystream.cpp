@@ -0,0 +1,595 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+
+#include <list>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+
+#include "keystream.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MT_KEYSTREAM_X86 1
+#include <immintrin.h>
+#endif
+
+
+static const int N = mt_keystream::N;
+static const int M = 397;
+static const uint32_t MATRIX_A = 0x9908b0dfU;
+static const uint32_t UPPER_MASK = 0x80000000U;
+static const uint32_t LOWER_MASK = 0x7fffffffU;
+
+struct keystream_kernel
+{
+	const char *name;
+	// Regenerates all N words of the state in place.
+	void (*twist)(uint32_t *mt);
+	// Tempers N state words.
+	void (*temper)(const uint32_t *mt, uint32_t *out);
+	// Tempers N state words and stores the low byte of each.
+	void (*temper_bytes)(const uint32_t *mt, uint8_t *out);
+	void (*xor_)(uint8_t *dst, const uint8_t *src, const uint8_t *key, size_t len);
+};
+
+
+// Scalar kernel. This is a direct translation of mt19937ar.cpp.
+static inline uint32_t twist_one(uint32_t a, uint32_t b, uint32_t m)
+{
+	uint32_t y = (a & UPPER_MASK) | (b & LOWER_MASK);
+	return m ^ (y >> 1) ^ ((0U - (y & 1)) & MATRIX_A);
+}
+
+static inline uint32_t temper_one(uint32_t y)
+{
+	y ^= (y >> 11);
+	y ^= (y << 7) & 0x9d2c5680U;
+	y ^= (y << 15) & 0xefc60000U;
+	y ^= (y >> 18);
+	return y;
+}
+
+static void twist_scalar(uint32_t *mt)
+{
+	int kk;
+	for (kk = 0; kk < N - M; kk++) {
+		mt[kk] = twist_one(mt[kk], mt[kk + 1], mt[kk + M]);
+	}
+	for (; kk < N - 1; kk++) {
+		mt[kk] = twist_one(mt[kk], mt[kk + 1], mt[kk + (M - N)]);
+	}
+	mt[N - 1] = twist_one(mt[N - 1], mt[0], mt[M - 1]);
+}
+
+static void temper_scalar(const uint32_t *mt, uint32_t *out)
+{
+	for (int i = 0; i < N; i++) {
+		out[i] = temper_one(mt[i]);
+	}
+}
+
+static void temper_bytes_scalar(const uint32_t *mt, uint8_t *out)
+{
+	for (int i = 0; i < N; i++) {
+		out[i] = (uint8_t)temper_one(mt[i]);
+	}
+}
+
+static void xor_scalar(uint8_t *dst, const uint8_t *src, const uint8_t *key, size_t len)
+{
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t a, b;
+		std::memcpy(&a, src + i, 8);
+		std::memcpy(&b, key + i, 8);
+		a ^= b;
+		std::memcpy(dst + i, &a, 8);
+	}
+	for (; i < len; i++) {
+		dst[i] = src[i] ^ key[i];
+	}
+}
+
+static const keystream_kernel kernel_scalar = {
+	"scalar", twist_scalar, temper_scalar, temper_bytes_scalar, xor_scalar,
+};
+
+
+#ifdef MT_KEYSTREAM_X86
+// SSE2 kernel: 4 words per step.
+// The first N-M words of the twist only read words that are not yet
+// regenerated and the rest read words regenerated N-M(=227) positions
+// earlier, so both loops can be processed several lanes at a time.
+__attribute__((target("sse2")))
+static inline __m128i twist4_sse2(__m128i a, __m128i b, __m128i m)
+{
+	const __m128i upper = _mm_set1_epi32(UPPER_MASK);
+	const __m128i lower = _mm_set1_epi32(LOWER_MASK);
+	const __m128i matrix = _mm_set1_epi32(MATRIX_A);
+	const __m128i one = _mm_set1_epi32(1);
+	__m128i y = _mm_or_si128(_mm_and_si128(a, upper), _mm_and_si128(b, lower));
+	__m128i mag = _mm_and_si128(_mm_cmpeq_epi32(_mm_and_si128(y, one), one), matrix);
+	return _mm_xor_si128(_mm_xor_si128(m, _mm_srli_epi32(y, 1)), mag);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i temper4_sse2(__m128i y)
+{
+	y = _mm_xor_si128(y, _mm_srli_epi32(y, 11));
+	y = _mm_xor_si128(y, _mm_and_si128(_mm_slli_epi32(y, 7), _mm_set1_epi32(0x9d2c5680U)));
+	y = _mm_xor_si128(y, _mm_and_si128(_mm_slli_epi32(y, 15), _mm_set1_epi32(0xefc60000U)));
+	y = _mm_xor_si128(y, _mm_srli_epi32(y, 18));
+	return y;
+}
+
+// Tempers 16 words and packs their low bytes.
+__attribute__((target("sse2")))
+static inline void temper_bytes16_sse2(const uint32_t *mt, uint8_t *out)
+{
+	const __m128i lowbyte = _mm_set1_epi32(0xff);
+	__m128i t0 = _mm_and_si128(temper4_sse2(_mm_loadu_si128((const __m128i *)(mt + 0))), lowbyte);
+	__m128i t1 = _mm_and_si128(temper4_sse2(_mm_loadu_si128((const __m128i *)(mt + 4))), lowbyte);
+	__m128i t2 = _mm_and_si128(temper4_sse2(_mm_loadu_si128((const __m128i *)(mt + 8))), lowbyte);
+	__m128i t3 = _mm_and_si128(temper4_sse2(_mm_loadu_si128((const __m128i *)(mt + 12))), lowbyte);
+	__m128i p = _mm_packus_epi16(_mm_packs_epi32(t0, t1), _mm_packs_epi32(t2, t3));
+	_mm_storeu_si128((__m128i *)out, p);
+}
+
+__attribute__((target("sse2")))
+static void twist_sse2(uint32_t *mt)
+{
+	int kk = 0;
+	for (; kk + 4 <= N - M; kk += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(mt + kk));
+		__m128i b = _mm_loadu_si128((const __m128i *)(mt + kk + 1));
+		__m128i m = _mm_loadu_si128((const __m128i *)(mt + kk + M));
+		_mm_storeu_si128((__m128i *)(mt + kk), twist4_sse2(a, b, m));
+	}
+	for (; kk < N - M; kk++) {
+		mt[kk] = twist_one(mt[kk], mt[kk + 1], mt[kk + M]);
+	}
+	for (; kk + 4 <= N - 1; kk += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(mt + kk));
+		__m128i b = _mm_loadu_si128((const __m128i *)(mt + kk + 1));
+		__m128i m = _mm_loadu_si128((const __m128i *)(mt + kk + (M - N)));
+		_mm_storeu_si128((__m128i *)(mt + kk), twist4_sse2(a, b, m));
+	}
+	for (; kk < N - 1; kk++) {
+		mt[kk] = twist_one(mt[kk], mt[kk + 1], mt[kk + (M - N)]);
+	}
+	mt[N - 1] = twist_one(mt[N - 1], mt[0], mt[M - 1]);
+}
+
+__attribute__((target("sse2")))
+static void temper_sse2(const uint32_t *mt, uint32_t *out)
+{
+	for (int i = 0; i < N; i += 4) {
+		__m128i y = _mm_loadu_si128((const __m128i *)(mt + i));
+		_mm_storeu_si128((__m128i *)(out + i), temper4_sse2(y));
+	}
+}
+
+__attribute__((target("sse2")))
+static void temper_bytes_sse2(const uint32_t *mt, uint8_t *out)
+{
+	for (int i = 0; i < N; i += 16) {
+		temper_bytes16_sse2(mt + i, out + i);
+	}
+}
+
+__attribute__((target("sse2")))
+static void xor_sse2(uint8_t *dst, const uint8_t *src, const uint8_t *key, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(key + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, b));
+	}
+	xor_scalar(dst + i, src + i, key + i, len - i);
+}
+
+static const keystream_kernel kernel_sse2 = {
+	"sse2", twist_sse2, temper_sse2, temper_bytes_sse2, xor_sse2,
+};
+
+
+// AVX2 kernel: 8 words per step.
+__attribute__((target("avx2")))
+static inline __m256i twist8_avx2(__m256i a, __m256i b, __m256i m)
+{
+	const __m256i upper = _mm256_set1_epi32(UPPER_MASK);
+	const __m256i lower = _mm256_set1_epi32(LOWER_MASK);
+	const __m256i matrix = _mm256_set1_epi32(MATRIX_A);
+	const __m256i one = _mm256_set1_epi32(1);
+	__m256i y = _mm256_or_si256(_mm256_and_si256(a, upper), _mm256_and_si256(b, lower));
+	__m256i mag = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_and_si256(y, one), one), matrix);
+	return _mm256_xor_si256(_mm256_xor_si256(m, _mm256_srli_epi32(y, 1)), mag);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i temper8_avx2(__m256i y)
+{
+	y = _mm256_xor_si256(y, _mm256_srli_epi32(y, 11));
+	y = _mm256_xor_si256(y, _mm256_and_si256(_mm256_slli_epi32(y, 7), _mm256_set1_epi32(0x9d2c5680U)));
+	y = _mm256_xor_si256(y, _mm256_and_si256(_mm256_slli_epi32(y, 15), _mm256_set1_epi32(0xefc60000U)));
+	y = _mm256_xor_si256(y, _mm256_srli_epi32(y, 18));
+	return y;
+}
+
+__attribute__((target("avx2")))
+static void twist_avx2(uint32_t *mt)
+{
+	int kk = 0;
+	for (; kk + 8 <= N - M; kk += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(mt + kk));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(mt + kk + 1));
+		__m256i m = _mm256_loadu_si256((const __m256i *)(mt + kk + M));
+		_mm256_storeu_si256((__m256i *)(mt + kk), twist8_avx2(a, b, m));
+	}
+	for (; kk < N - M; kk++) {
+		mt[kk] = twist_one(mt[kk], mt[kk + 1], mt[kk + M]);
+	}
+	for (; kk + 8 <= N - 1; kk += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(mt + kk));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(mt + kk + 1));
+		__m256i m = _mm256_loadu_si256((const __m256i *)(mt + kk + (M - N)));
+		_mm256_storeu_si256((__m256i *)(mt + kk), twist8_avx2(a, b, m));
+	}
+	for (; kk < N - 1; kk++) {
+		mt[kk] = twist_one(mt[kk], mt[kk + 1], mt[kk + (M - N)]);
+	}
+	mt[N - 1] = twist_one(mt[N - 1], mt[0], mt[M - 1]);
+}
+
+__attribute__((target("avx2")))
+static void temper_avx2(const uint32_t *mt, uint32_t *out)
+{
+	for (int i = 0; i < N; i += 8) {
+		__m256i y = _mm256_loadu_si256((const __m256i *)(mt + i));
+		_mm256_storeu_si256((__m256i *)(out + i), temper8_avx2(y));
+	}
+}
+
+__attribute__((target("avx2")))
+static void temper_bytes_avx2(const uint32_t *mt, uint8_t *out)
+{
+	const __m256i lowbyte = _mm256_set1_epi32(0xff);
+	// The pack instructions work within 128bit lanes; this puts the dwords back in order.
+	const __m256i perm = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	int i = 0;
+	for (; i + 32 <= N; i += 32) {
+		__m256i t0 = _mm256_and_si256(temper8_avx2(_mm256_loadu_si256((const __m256i *)(mt + i + 0))), lowbyte);
+		__m256i t1 = _mm256_and_si256(temper8_avx2(_mm256_loadu_si256((const __m256i *)(mt + i + 8))), lowbyte);
+		__m256i t2 = _mm256_and_si256(temper8_avx2(_mm256_loadu_si256((const __m256i *)(mt + i + 16))), lowbyte);
+		__m256i t3 = _mm256_and_si256(temper8_avx2(_mm256_loadu_si256((const __m256i *)(mt + i + 24))), lowbyte);
+		__m256i p = _mm256_packus_epi16(_mm256_packs_epi32(t0, t1), _mm256_packs_epi32(t2, t3));
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_permutevar8x32_epi32(p, perm));
+	}
+	for (; i < N; i += 16) {
+		temper_bytes16_sse2(mt + i, out + i);
+	}
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2(uint8_t *dst, const uint8_t *src, const uint8_t *key, size_t len)
+{
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(key + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, b));
+	}
+	xor_sse2(dst + i, src + i, key + i, len - i);
+}
+
+static const keystream_kernel kernel_avx2 = {
+	"avx2", twist_avx2, temper_avx2, temper_bytes_avx2, xor_avx2,
+};
+#endif
+
+
+// Picks the best kernel supported by the running cpu.
+// MABIPACK_KEYSTREAM_KERNEL=scalar|sse2|avx2 can be used to force a slower one.
+static const keystream_kernel *select_kernel()
+{
+	const char *force = getenv("MABIPACK_KEYSTREAM_KERNEL");
+	if (force && !strcmp(force, "scalar")) {
+		return &kernel_scalar;
+	}
+#ifdef MT_KEYSTREAM_X86
+	__builtin_cpu_init();
+	bool have_sse2 = __builtin_cpu_supports("sse2");
+	bool have_avx2 = __builtin_cpu_supports("avx2");
+	if (force && !strcmp(force, "sse2") && have_sse2) {
+		return &kernel_sse2;
+	}
+	if (have_avx2) {
+		return &kernel_avx2;
+	}
+	if (have_sse2) {
+		return &kernel_sse2;
+	}
+#endif
+	return &kernel_scalar;
+}
+
+static const keystream_kernel *kernel()
+{
+	static const keystream_kernel *k = select_kernel();
+	return k;
+}
+
+
+mt_keystream::mt_keystream()
+{
+	init(5489U);
+}
+
+mt_keystream::mt_keystream(uint32_t seed)
+{
+	init(seed);
+}
+
+void mt_keystream::init(uint32_t seed)
+{
+	mt_[0] = seed;
+	for (int i = 1; i < N; i++) {
+		mt_[i] = 1812433253U * (mt_[i - 1] ^ (mt_[i - 1] >> 30)) + i;
+	}
+	pos_ = N;
+}
+
+void mt_keystream::refill()
+{
+	const keystream_kernel *k = kernel();
+	k->twist(mt_);
+	k->temper_bytes(mt_, bytes_);
+	pos_ = 0;
+}
+
+void mt_keystream::next_block(uint32_t *out)
+{
+	assert(pos_ == N);
+	const keystream_kernel *k = kernel();
+	k->twist(mt_);
+	k->temper(mt_, out);
+}
+
+void mt_keystream::next_block_bytes(uint8_t *out)
+{
+	assert(pos_ == N);
+	const keystream_kernel *k = kernel();
+	k->twist(mt_);
+	k->temper_bytes(mt_, out);
+}
+
+void mt_keystream::keystream_bytes(uint8_t *out, size_t len)
+{
+	size_t n = N - pos_;
+	if (n > len) {
+		n = len;
+	}
+	std::memcpy(out, bytes_ + pos_, n);
+	pos_ += n;
+	out += n;
+	len -= n;
+
+	while (len >= (size_t)N) {
+		next_block_bytes(out);
+		out += N;
+		len -= N;
+	}
+	if (len > 0) {
+		refill();
+		std::memcpy(out, bytes_, len);
+		pos_ = len;
+	}
+}
+
+void mt_keystream::xor_bytes(char *buf, size_t len)
+{
+	const keystream_kernel *k = kernel();
+	uint8_t *p = (uint8_t *)buf;
+	while (len > 0) {
+		if (pos_ == N) {
+			refill();
+		}
+		size_t n = N - pos_;
+		if (n > len) {
+			n = len;
+		}
+		k->xor_(p, p, bytes_ + pos_, n);
+		pos_ += n;
+		p += n;
+		len -= n;
+	}
+}
+
+void mt_keystream::discard(size_t n)
+{
+	size_t buffered = N - pos_;
+	if (n <= buffered) {
+		pos_ += n;
+		return;
+	}
+	n -= buffered;
+	pos_ = N;
+
+	const keystream_kernel *k = kernel();
+	for (; n >= (size_t)N; n -= N) {
+		k->twist(mt_);
+	}
+	if (n > 0) {
+		refill();
+		pos_ = n;
+	}
+}
+
+const char *mt_keystream::kernel_name()
+{
+	return kernel()->name;
+}
+
+void keystream_xor(uint8_t *dst, const uint8_t *src, const uint8_t *key, size_t len)
+{
+	kernel()->xor_(dst, src, key, len);
+}
+
+// Slices smaller than this are not worth a thread.
+static const size_t KEYSTREAM_MIN_SLICE = 1024 * 1024;
+
+void keystream_xor_parallel(uint32_t seed, char *buf, size_t len, int nthreads)
+{
+	mt_keystream ks(seed);
+	if (nthreads > 1 && len / nthreads < KEYSTREAM_MIN_SLICE) {
+		nthreads = len / KEYSTREAM_MIN_SLICE;
+	}
+	if (nthreads <= 1) {
+		ks.xor_bytes(buf, len);
+		return;
+	}
+
+	// Slices are whole blocks so that each worker starts on a block boundary.
+	size_t slice = (len / nthreads + N - 1) / N * N;
+	std::vector<std::thread> workers;
+	size_t off = 0;
+	for (int i = 0; i < nthreads - 1 && off + slice < len; i++) {
+		char *p = buf + off;
+		workers.push_back(std::thread([ks, p, slice]() mutable {
+			ks.xor_bytes(p, slice);
+		}));
+		ks.discard(slice);
+		off += slice;
+	}
+	ks.xor_bytes(buf + off, len - off);
+
+	for (std::thread &t : workers) {
+		t.join();
+	}
+}
+
+// Cached streams are extended in steps of this size so that a series of
+// slightly longer requests does not regenerate and copy the stream every time.
+static const size_t KEYSTREAM_CACHE_GROW_STEP = 64 * 1024;
+// Seeds remembered as requested once, at most. The set is started over
+// when it is full.
+static const size_t KEYSTREAM_CACHE_MAX_SEEN = 65536;
+
+KeystreamCache::KeystreamCache(size_t max_bytes)
+	: max_bytes_(max_bytes)
+{
+	std::memset(&stats_, 0, sizeof(stats_));
+}
+
+KeystreamCache::~KeystreamCache()
+{
+}
+
+KeystreamCache::stream_ptr KeystreamCache::get(uint32_t seed, size_t len)
+{
+	if (len > max_bytes_) {
+		std::lock_guard<std::mutex> guard(lock_);
+		stats_.misses++;
+		return nullptr;
+	}
+
+	mt_keystream gen;
+	std::shared_ptr<std::vector<uint8_t>> old;
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		auto it = entries_.find(seed);
+		if (it != entries_.end()) {
+			entry &ent = it->second;
+			lru_.splice(lru_.begin(), lru_, ent.lru_pos);
+			if (ent.bytes->size() >= len) {
+				stats_.hits++;
+				return ent.bytes;
+			}
+			gen = ent.gen;
+			old = ent.bytes;
+		} else if (seen_.erase(seed)) {
+			gen.init(seed);
+		} else {
+			if (seen_.size() >= KEYSTREAM_CACHE_MAX_SEEN) {
+				seen_.clear();
+			}
+			seen_.insert(seed);
+			stats_.misses++;
+			return nullptr;
+		}
+		stats_.misses++;
+	}
+
+	// Generate outside the lock; readers of the old stream keep their copy.
+	// A new stream is exactly `len' bytes long; only extensions are rounded.
+	size_t oldlen = old ? old->size() : 0;
+	size_t newlen = len;
+	if (old) {
+		newlen = (len + KEYSTREAM_CACHE_GROW_STEP - 1) / KEYSTREAM_CACHE_GROW_STEP * KEYSTREAM_CACHE_GROW_STEP;
+		if (newlen > max_bytes_) {
+			newlen = len;
+		}
+	}
+	std::shared_ptr<std::vector<uint8_t>> bytes(new std::vector<uint8_t>(newlen));
+	if (oldlen > 0) {
+		std::memcpy(bytes->data(), old->data(), oldlen);
+	}
+	gen.keystream_bytes(bytes->data() + oldlen, newlen - oldlen);
+
+	std::lock_guard<std::mutex> guard(lock_);
+	stats_.bytes_generated += newlen - oldlen;
+	auto it = entries_.find(seed);
+	if (it == entries_.end()) {
+		lru_.push_front(seed);
+		entry &ent = entries_[seed];
+		ent.lru_pos = lru_.begin();
+		ent.gen = gen;
+		ent.bytes = bytes;
+		stats_.bytes_cached += newlen;
+	} else if (it->second.bytes->size() < newlen) {
+		// Another thread may have extended the stream meanwhile; keep the longest.
+		stats_.bytes_cached += newlen - it->second.bytes->size();
+		it->second.gen = gen;
+		it->second.bytes = bytes;
+	}
+	evict_locked(seed);
+	return bytes;
+}
+
+void KeystreamCache::evict_locked(uint32_t keep_seed)
+{
+	while (stats_.bytes_cached > max_bytes_ && !lru_.empty()) {
+		uint32_t victim = lru_.back();
+		if (victim == keep_seed) {
+			break;
+		}
+		auto it = entries_.find(victim);
+		stats_.bytes_cached -= it->second.bytes->size();
+		entries_.erase(it);
+		lru_.pop_back();
+	}
+}
+
+KeystreamCache::stats_t KeystreamCache::stats() const
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	return stats_;
+}
+
+void KeystreamCache::clear()
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	entries_.clear();
+	lru_.clear();
+	seen_.clear();
+	stats_.bytes_cached = 0;
+}
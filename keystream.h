@@ -0,0 +1,106 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+#pragma once
+
+// Block-oriented MT19937 keystream.
+// Produces exactly the same sequence as mt19937ar::genrand_int32(), but
+// regenerates the whole 624-word state at once on 32bit words so that the
+// twist and tempering steps can be vectorized. Pack contents are encrypted
+// with the low byte of each output, which is what keystream_bytes() returns.
+class mt_keystream
+{
+public:
+	static const int N = 624;
+
+public:
+	mt_keystream();
+	explicit mt_keystream(uint32_t seed);
+
+	void init(uint32_t seed);
+
+	// Generates the next N tempered outputs.
+	void next_block(uint32_t *out);
+	// Generates the low bytes of the next N outputs.
+	void next_block_bytes(uint8_t *out);
+	// Returns the low bytes of the next `len' outputs.
+	void keystream_bytes(uint8_t *out, size_t len);
+	// XORs the low bytes of the next `len' outputs into buf.
+	void xor_bytes(char *buf, size_t len);
+	// Jumps ahead by `n' outputs. Whole blocks only run the twist step, so
+	// this is considerably cheaper than generating the skipped outputs.
+	void discard(size_t n);
+
+	// Name of the kernel selected at runtime. ("scalar", "sse2" or "avx2")
+	static const char *kernel_name();
+
+private:
+	void refill();
+
+private:
+	uint32_t mt_[N] __attribute__((aligned(32)));
+	uint8_t bytes_[N] __attribute__((aligned(32)));
+	int pos_;
+};
+
+// dst[i] = src[i] ^ key[i] for i in [0, len). dst may be equal to src.
+void keystream_xor(uint8_t *dst, const uint8_t *src, const uint8_t *key, size_t len);
+
+// Same as mt_keystream(seed).xor_bytes(buf, len), split across `nthreads' threads.
+// The calling thread jumps the generator to the start of each slice and hands
+// a copy of the state to a worker, then processes the last slice itself.
+void keystream_xor_parallel(uint32_t seed, char *buf, size_t len, int nthreads);
+
+// Bounded cache of expanded keystreams, keyed by seed.
+// A pack entry's keystream only depends on its seed and many entries share
+// seeds, so the bytes generated for one entry can be reused by the next one.
+// A seed is only cached from its second request on, so that packs whose
+// entries all have their own seed do not pay for copying every stream into
+// the cache. Each seed's stream grows lazily to the longest length
+// requested so far.
+// Safe to share between threads and between packs.
+class KeystreamCache
+{
+public:
+	typedef std::shared_ptr<const std::vector<uint8_t>> stream_ptr;
+
+	struct stats_t
+	{
+		uint64_t hits;
+		uint64_t misses;
+		// Keystream bytes currently held by the cache.
+		uint64_t bytes_cached;
+		// Keystream bytes generated for the cache so far.
+		uint64_t bytes_generated;
+	};
+
+public:
+	explicit KeystreamCache(size_t max_bytes);
+	~KeystreamCache();
+
+	// Returns at least `len' keystream bytes for `seed'.
+	// Returns nullptr, and the caller generates the stream itself, on the
+	// first request for `seed' or if the stream would not fit in the cache.
+	stream_ptr get(uint32_t seed, size_t len);
+	stats_t stats() const;
+	void clear();
+
+private:
+	struct entry
+	{
+		mt_keystream gen;
+		std::shared_ptr<std::vector<uint8_t>> bytes;
+		std::list<uint32_t>::iterator lru_pos;
+	};
+
+	void evict_locked(uint32_t keep_seed);
+
+private:
+	size_t max_bytes_;
+	mutable std::mutex lock_;
+	std::map<uint32_t, entry> entries_;
+	// Most recently used seed first.
+	std::list<uint32_t> lru_;
+	// Seeds requested once but not cached yet.
+	std::set<uint32_t> seen_;
+	stats_t stats_;
+};
@@ -4,7 +4,13 @@
 #include <string>
 #include <list>
 #include <map>
+#include <set>
 #include <vector>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
 
 #include <cstdio>
 #include <cstdlib>
@@ -17,17 +23,226 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <zlib.h>
 
 #include "mabipack.h"
-#include "mt19937ar.h"
+#include "keystream.h"
+#include "contentcache.h"
+#include "workqueue.h"
+#include "fileutil.h"
 
 #if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
 #error This program only works under little endian cpus.
 #endif
 
 
+// XORs the keystream of `seed' into buf, using `cache' if possible.
+static void apply_keystream(KeystreamCache *cache, uint32_t seed, char *buf, size_t len)
+{
+	if (cache) {
+		KeystreamCache::stream_ptr stream = cache->get(seed, len);
+		if (stream) {
+			keystream_xor((uint8_t *)buf, (const uint8_t *)buf, stream->data(), len);
+			return;
+		}
+	}
+	mt_keystream ks(seed);
+	ks.xor_bytes(buf, len);
+}
+
+// Reads up to `len' bytes at `off', stopping early only at end of file.
+// Returns the number of bytes read or <0 on error.
+static ssize_t pread_some(int fd, char *buf, size_t len, off_t off)
+{
+	size_t total = 0;
+	while (total < len) {
+		ssize_t nread = ::pread(fd, buf + total, len - total, off + total);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread < 0) {
+			return -1;
+		}
+		if (nread == 0) {
+			break;
+		}
+		total += nread;
+	}
+	return total;
+}
+
+// Reads exactly `len' bytes at `off'. Returns <0 on error or short read.
+static int pread_full(int fd, char *buf, size_t len, off_t off)
+{
+	ssize_t nread = pread_some(fd, buf, len, off);
+	if (nread < 0 || (size_t)nread != len) {
+		return -1;
+	}
+	return 0;
+}
+
+// Compresses `filefd' from its current position to the end into one zlib
+// stream, a chunk at a time. Gives the same output as compress2() at level 9.
+// The stream is passed to `emit' in order and the input size is stored in
+// `size'. Returns <0 on error and errno is set appropriately.
+static int deflate_file(int filefd, uint64_t &size, const std::function<int(char *, size_t)> &emit)
+{
+	static const size_t CHUNK = MABIPACK_STREAM_CHUNK;
+
+	z_stream zs;
+	std::memset(&zs, 0, sizeof (zs));
+	if (deflateInit(&zs, 9) != Z_OK) {
+		errno = EIO;
+		return -4;
+	}
+
+	std::vector<char> buf(2 * CHUNK);
+	char *inbuf = &buf[0];
+	char *outbuf = &buf[CHUNK];
+	size = 0;
+	int flush = Z_NO_FLUSH;
+	int ret = Z_OK;
+	while (flush != Z_FINISH) {
+		ssize_t nread = ::read(filefd, inbuf, CHUNK);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread < 0) {
+			PreserveErrno pe;
+			deflateEnd(&zs);
+			return -3;
+		}
+		size += nread;
+		flush = nread == 0 ? Z_FINISH : Z_NO_FLUSH;
+		zs.next_in = (Bytef *)inbuf;
+		zs.avail_in = nread;
+		do {
+			zs.next_out = (Bytef *)outbuf;
+			zs.avail_out = CHUNK;
+			ret = deflate(&zs, flush);
+			if (emit(outbuf, CHUNK - zs.avail_out) < 0) {
+				PreserveErrno pe;
+				deflateEnd(&zs);
+				return -5;
+			}
+		} while (zs.avail_out == 0);
+	}
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END) {
+		errno = EIO;
+		return -4;
+	}
+	return 0;
+}
+
+// Compresses the first `size' bytes of `filefd' into one zlib stream made
+// of independently deflated blocks, the way pigz does: every block is a raw
+// deflate primed with the last 32 KiB of the previous block's input and
+// ended with a sync flush (the last one with Z_FINISH), so the blocks can be
+// compressed in parallel and simply concatenated. The adler32 checksums of
+// the blocks are combined for the zlib trailer.
+// The stream is passed to `emit' in order. Returns <0 on error and errno is
+// set appropriately.
+static int deflate_blocks(int filefd, uint64_t size, int nthreads, const std::function<int(char *, size_t)> &emit)
+{
+	static const size_t BLOCK = MABIPACK_DEFLATE_BLOCK;
+	static const size_t DICT = 32768;
+
+	struct block
+	{
+		std::vector<char> data;
+		uLong check;
+	};
+	size_t nblocks = (size + BLOCK - 1) / BLOCK;
+	std::vector<block> blocks(nblocks);
+
+	// zlib header for the default window and level 9
+	char header[2] = {'\x78', '\xda'};
+	if (emit(header, sizeof (header)) < 0) {
+		return -5;
+	}
+
+	uLong check = adler32(0, nullptr, 0);
+	int err = 0;
+	run_ordered(nblocks, nthreads, nthreads * 2,
+		[&](size_t i) {
+			uint64_t off = (uint64_t)i * BLOCK;
+			size_t len = std::min((uint64_t)BLOCK, size - off);
+			size_t dict = std::min((uint64_t)DICT, off);
+			std::vector<char> in(dict + len);
+			if (pread_full(filefd, in.data(), in.size(), off - dict) < 0) {
+				return -3;
+			}
+
+			z_stream zs;
+			std::memset(&zs, 0, sizeof (zs));
+			if (deflateInit2(&zs, 9, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				return -4;
+			}
+			if (dict > 0 && deflateSetDictionary(&zs, (const Bytef *)in.data(), dict) != Z_OK) {
+				deflateEnd(&zs);
+				return -4;
+			}
+			int flush = i + 1 == nblocks ? Z_FINISH : Z_SYNC_FLUSH;
+			std::vector<char> &out = blocks[i].data;
+			// deflateBound() does not count the sync flush marker.
+			out.resize(deflateBound(&zs, len) + 16);
+			zs.next_in = (Bytef *)in.data() + dict;
+			zs.avail_in = len;
+			int ret;
+			do {
+				size_t used = zs.total_out;
+				if (used == out.size()) {
+					out.resize(out.size() * 2);
+				}
+				zs.next_out = (Bytef *)out.data() + used;
+				zs.avail_out = out.size() - used;
+				ret = deflate(&zs, flush);
+			} while (ret == Z_OK && (zs.avail_out == 0 || flush == Z_FINISH));
+			if (ret == Z_BUF_ERROR && flush != Z_FINISH && zs.avail_in == 0) {
+				// the output ended exactly at the end of the buffer
+				ret = Z_OK;
+			}
+			out.resize(zs.total_out);
+			deflateEnd(&zs);
+			if (ret != (flush == Z_FINISH ? Z_STREAM_END : Z_OK)) {
+				return -4;
+			}
+			blocks[i].check = adler32(adler32(0, nullptr, 0), (const Bytef *)in.data() + dict, len);
+			return 0;
+		},
+		[&](size_t i, int ret) {
+			if (ret >= 0 && emit(blocks[i].data.data(), blocks[i].data.size()) < 0) {
+				ret = -5;
+			}
+			if (ret < 0) {
+				err = ret;
+				return false;
+			}
+			uint64_t off = (uint64_t)i * BLOCK;
+			check = adler32_combine(check, blocks[i].check, std::min((uint64_t)BLOCK, size - off));
+			std::vector<char>().swap(blocks[i].data);
+			return true;
+		});
+	if (err < 0) {
+		if (err != -5) {
+			// Read errors happened on a worker thread; their errno is lost.
+			errno = EIO;
+		}
+		return err;
+	}
+
+	char trailer[4] = {
+		(char)(check >> 24), (char)(check >> 16), (char)(check >> 8), (char)check,
+	};
+	if (emit(trailer, sizeof (trailer)) < 0) {
+		return -5;
+	}
+	return 0;
+}
+
 uint64_t unix_ts_to_filetime(time_t unix_ts, int utc_offset=MABIPACK_DEFAULT_TIMEZONE)
 {
 	return (unix_ts + utc_offset + 11644473600) * 10000000;
@@ -36,6 +251,15 @@ uint64_t unix_ts_to_filetime(time_t unix_ts, int utc_offset=MABIPACK_DEFAULT_TIM
 
 MabiPack::MabiPack()
 	: fd_(-1)
+	, ks_cache_(nullptr)
+	, content_cache_(nullptr)
+	, decrypt_threads_(1)
+	, decrypt_threshold_(0)
+	, map_(nullptr)
+	, map_size_(0)
+	, raw_index_(nullptr)
+	, raw_index_size_(0)
+	, index_loaded_(false)
 {
 }
 
@@ -44,7 +268,7 @@ MabiPack::~MabiPack()
 	closepack();
 }
 
-int MabiPack::openpack(const std::string &path)
+int MabiPack::openpack(const std::string &path, int flags)
 {
 	assert(fd_ < 0);
 
@@ -53,154 +277,608 @@ int MabiPack::openpack(const std::string &path)
 		return -1;
 	}
 
-	int nread = ::read(fd, &header_, sizeof (header_));
-	if (nread != sizeof (header_)) {
-		::close(fd);
-		return -2;
+	if (flags & MABIPACK_OPEN_MMAP) {
+		struct stat sb;
+		if (::fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof (header_)) {
+			::close(fd);
+			return -2;
+		}
+		void *map = ::mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			::close(fd);
+			return -6;
+		}
+		if (flags & MABIPACK_ADVISE_SEQUENTIAL) {
+			::madvise(map, sb.st_size, MADV_SEQUENTIAL);
+		} else if (flags & MABIPACK_ADVISE_RANDOM) {
+			::madvise(map, sb.st_size, MADV_RANDOM);
+		}
+		map_ = (const char *)map;
+		map_size_ = sb.st_size;
+		std::memcpy(&header_, map_, sizeof (header_));
+	} else {
+		int nread = ::read(fd, &header_, sizeof (header_));
+		if (nread != sizeof (header_)) {
+			::close(fd);
+			return -2;
+		}
 	}
+	fd_ = fd;
+
 	if (std::memcmp(header_.magic, "PACK", 4)) {
-		::close(fd);
+		closepack();
 		return -3;
 	}
 	if (std::memcmp(header_.pack_revision, "\2\1\0\0", 4)) {
-		::close(fd);
+		closepack();
 		return -4;
 	}
 	header_.mountpoint[sizeof(header_.mountpoint) - 1] = '\0';
-	fd_ = fd;
 
-	for (unsigned int i = 0; i < header_.filecnt; i++) {
-		filelist_t::value_type entry = read_fileinfo(fd);
-		if (entry.first.empty()) {
+	std::string index_cache_path;
+	pack_index_key index_key;
+	if (flags & MABIPACK_OPEN_INDEX_CACHE) {
+		struct stat sb;
+		if (::fstat(fd, &sb) == 0) {
+			index_cache_path = path + ".idx";
+			index_key.pack_size = sb.st_size;
+			index_key.pack_mtime_sec = sb.st_mtim.tv_sec;
+			index_key.pack_mtime_nsec = sb.st_mtim.tv_nsec;
+			index_key.pack_version = header_.version;
+			index_key.filecnt = header_.filecnt;
+			if (files_.load(index_cache_path, index_key) == 0) {
+				index_loaded_.store(true);
+				return 0;
+			}
+		}
+	}
+
+	// Record where the index is.
+	if (read_raw_index(raw_index_buf_, raw_index_, raw_index_size_) < 0) {
+		closepack();
+		return -5;
+	}
+
+	if (!(flags & MABIPACK_OPEN_LAZY) || !index_cache_path.empty()) {
+		int ret = load_index();
+		if (ret < 0) {
 			closepack();
 			return -5;
 		}
-		files_.insert(entry);
+		// Nothing scans the on-disk index once files_ is built.
+		std::vector<char>().swap(raw_index_buf_);
+		raw_index_ = nullptr;
+		raw_index_size_ = 0;
+
+		// The sidecar is only an optimization; failing to write it is not an error.
+		if (!index_cache_path.empty()) {
+			files_.save(index_cache_path, index_key);
+		}
 	}
 
 	return 0;
 }
 
-MabiPack::filelist_t::value_type MabiPack::read_fileinfo(int fd)
+// One entry of the on-disk file index, pointing into the index region.
+struct raw_fileinfo
 {
-	assert(fd_ >= 0);
-
-	int nread;
+	// Windows style path. Short names are padded with nulls.
+	const char *name;
+	uint32_t namelen;
+	// Unaligned file_info.
+	const char *info;
+};
 
+// Decodes the index entry at `p' and advances `p' past it. Returns <0 on error.
+static int next_raw_fileinfo(const char *&p, const char *end, raw_fileinfo &out)
+{
 	// read filename length
-	char nametype;
+	if (end - p < 1) {
+		return -1;
+	}
+	char nametype = *p++;
 	uint32_t namelen;
-	nread = ::read(fd, &nametype, 1);
-	if (nread != 1) {
-		return filelist_t::value_type();
-	} else if (nametype < 4) {
+	if (nametype < 4) {
 		namelen = (0x10 * (nametype + 1)) - 1;
 	} else if (nametype == 4) {
 		namelen = 0x60 - 1;
 	} else if (nametype == 5) {
-		nread = ::read(fd, &namelen, 4);
-		if (nread != 4) {
-			return filelist_t::value_type();
+		if (end - p < 4) {
+			return -1;
 		}
+		std::memcpy(&namelen, p, 4);
+		p += 4;
 	} else {
-		return filelist_t::value_type();
+		return -1;
 	}
 
-	// read filename
-	char filename[512];
-	if (namelen >= sizeof (filename) - 1) {
-		return filelist_t::value_type();
+	// filename
+	if (namelen >= 512 - 1 || (size_t)(end - p) < namelen) {
+		return -1;
+	}
+	out.name = p;
+	out.namelen = namelen;
+	p += namelen;
+
+	// fileinfo
+	if ((size_t)(end - p) < sizeof (file_info)) {
+		return -1;
+	}
+	out.info = p;
+	p += sizeof (file_info);
+	return 0;
+}
+
+// Points `p' at the on-disk file index, reading it into `buf' with one pread
+// unless the pack is mapped. The index region may be cut short in packs
+// without data, so `size' is what is actually there; entries are
+// bounds-checked against it.
+int MabiPack::read_raw_index(std::vector<char> &buf, const char *&p, size_t &size) const
+{
+	if (map_) {
+		p = map_ + sizeof (header_);
+		size = std::min<size_t>(header_.fileinfo_size, map_size_ - sizeof (header_));
+		return 0;
+	}
+	buf.resize(header_.fileinfo_size);
+	ssize_t nread = pread_some(fd_, buf.data(), header_.fileinfo_size, sizeof (header_));
+	if (nread < 0) {
+		return -1;
+	}
+	p = buf.data();
+	size = nread;
+	return 0;
+}
+
+void MabiPack::release_index()
+{
+	std::lock_guard<std::mutex> guard(index_lock_);
+	dirs_.clear();
+	files_.clear();
+	std::vector<char>().swap(raw_index_buf_);
+	raw_index_ = nullptr;
+	raw_index_size_ = 0;
+	index_loaded_.store(false);
+}
+
+const MabiPack::filelist_t &MabiPack::folded_files() const
+{
+	const filelist_t &files = this->files();
+	std::lock_guard<std::mutex> guard(index_lock_);
+	if (!files_.is_folded()) {
+		const_cast<filelist_t &>(files).fold();
+	}
+	return files_;
+}
+
+const DirTree &MabiPack::dir_tree() const
+{
+	const filelist_t &files = folded_files();
+	std::lock_guard<std::mutex> guard(index_lock_);
+	if (dirs_.empty()) {
+		const_cast<DirTree &>(dirs_).build(files);
+	}
+	return dirs_;
+}
+
+int MabiPack::load_index()
+{
+	if (index_loaded_.load(std::memory_order_acquire)) {
+		return 0;
+	}
+	std::lock_guard<std::mutex> guard(index_lock_);
+	if (index_loaded_.load(std::memory_order_relaxed)) {
+		return 0;
+	}
+
+	const char *p = raw_index_;
+	size_t size = raw_index_size_;
+	std::vector<char> buf;
+	if (!p) {
+		// released by release_index()
+		if (read_raw_index(buf, p, size) < 0) {
+			return -1;
+		}
+	}
+	const char *end = p + size;
+	files_.clear();
+	// filecnt comes from the pack and is only trusted as far as the index
+	// could actually hold that many entries.
+	files_.reserve(std::min<size_t>(header_.filecnt, size / (1 + sizeof (file_info))), size);
+	for (unsigned int i = 0; i < header_.filecnt; i++) {
+		if (parse_fileinfo(p, end) < 0) {
+			files_.clear();
+			return -1;
+		}
 	}
-	nread = ::read(fd, filename, namelen);
-	if (nread != (int)namelen) {
-		return filelist_t::value_type();
+	files_.finish();
+	index_loaded_.store(true, std::memory_order_release);
+	return 0;
+}
+
+// Parses one file index entry from memory and adds it to files_.
+// On success `p' is advanced past the entry. Returns <0 on error.
+int MabiPack::parse_fileinfo(const char *&p, const char *end)
+{
+	raw_fileinfo raw;
+	if (next_raw_fileinfo(p, end, raw) < 0) {
+		return -1;
 	}
-	filename[namelen] = 0;
+
+	char filename[512];
+	std::memcpy(filename, raw.name, raw.namelen);
+	filename[raw.namelen] = 0;
 
 	// convert windows style path separators to unix style
-	for (char *p = filename; p < filename + namelen; p++) {
-		if (*p == '\\') {
-			*p = '/';
+	for (char *q = filename; q < filename + raw.namelen; q++) {
+		if (*q == '\\') {
+			*q = '/';
 		}
 	}
 
-	// read fileinfo
 	file_info entry;
-	nread = ::read(fd, &entry, sizeof (entry));
-	if (nread != sizeof (entry)) {
-		return filelist_t::value_type();
+	std::memcpy(&entry, raw.info, sizeof (entry));
+
+	// Short names are padded with nulls.
+	size_t len = ::strlen(filename);
+	if (len == 0) {
+		return -1;
 	}
+	files_.add(filename, len, entry);
+	return 0;
+}
 
-	return std::make_pair(std::string(filename), entry);
+// Looks `path' up by walking the on-disk index in place, without building
+// the index. Used by lookups on a lazily opened pack.
+bool MabiPack::scan_index(const std::string &path, file_info &entry) const
+{
+	const char *p = raw_index_;
+	const char *end = p + raw_index_size_;
+	size_t len = path.size();
+	for (unsigned int i = 0; i < header_.filecnt; i++) {
+		raw_fileinfo raw;
+		if (next_raw_fileinfo(p, end, raw) < 0) {
+			return false;
+		}
+		if (len == 0 || len > raw.namelen || (len < raw.namelen && raw.name[len] != '\0')) {
+			continue;
+		}
+		size_t j = 0;
+		for (; j < len; j++) {
+			char c = raw.name[j] == '\\' ? '/' : raw.name[j];
+			if (c != path[j]) {
+				break;
+			}
+		}
+		if (j == len) {
+			std::memcpy(&entry, raw.info, sizeof (entry));
+			return true;
+		}
+	}
+	return false;
 }
 
 int MabiPack::closepack()
 {
+	if (map_) {
+		::munmap((void *)map_, map_size_);
+		map_ = nullptr;
+		map_size_ = 0;
+	}
 	if (fd_ >= 0) {
 		::close(fd_);
 		fd_ = -1;
+		dirs_.clear();
 		files_.clear();
+		if (content_cache_) {
+			content_cache_->forget(this);
+		}
 	}
+	std::vector<char>().swap(raw_index_buf_);
+	raw_index_ = nullptr;
+	raw_index_size_ = 0;
+	index_loaded_.store(false);
 	return 0;
 }
 
-char *MabiPack::decode_file_contents(const file_info &entry, char *compressed)
+int MabiPack::decode_file_contents(const file_info &entry, char *compressed, char *out) const
 {
 	uint32_t seed = (entry.seed << 7) ^ 0xa9c36de1;
-	mt19937ar mt(seed);
-	for (unsigned int i = 0; i < entry.size_compressed; i++) {
-		compressed[i] ^= mt.genrand_int32();
+	if (decrypt_threads_ > 1 && entry.size_compressed >= decrypt_threshold_) {
+		keystream_xor_parallel(seed, compressed, entry.size_compressed, decrypt_threads_);
+	} else {
+		apply_keystream(ks_cache_, seed, compressed, entry.size_compressed);
 	}
 
 	uLongf outlen = entry.size_orig;
-	char *data = new char[entry.size_orig];
-	int ret = uncompress((Bytef *)data, &outlen, (Bytef *)compressed, entry.size_compressed);
+	int ret = uncompress((Bytef *)out, &outlen, (Bytef *)compressed, entry.size_compressed);
 	if (ret != Z_OK || outlen != entry.size_orig) {
 		fprintf(stderr, "uncompress: %d\n", ret);
-		delete[] data;
-		return nullptr;
+		return -1;
 	}
 
-	return data;
+	return 0;
 }
 
-char *MabiPack::readfile(const file_info &entry)
+// Working state of decode_chunked(), kept per thread so that decoding one
+// entry after another does not allocate: the chunk buffers stay at their
+// size and the inflate state is reset instead of set up again.
+struct decode_scratch
+{
+	decode_scratch()
+		: zs_ready(false), busy(false)
+	{
+	}
+	~decode_scratch()
+	{
+		if (zs_ready) {
+			inflateEnd(&zs);
+		}
+	}
+
+	std::vector<uint8_t> buf;
+	z_stream zs;
+	bool zs_ready;
+	// Set while a decode uses it. A sink that reads another entry gets a
+	// private one instead.
+	bool busy;
+};
+static thread_local decode_scratch t_decode_scratch;
+
+struct decode_scratch_guard
+{
+	decode_scratch &scratch;
+	~decode_scratch_guard() { scratch.busy = false; }
+};
+
+// Decrypts and inflates an entry a chunk at a time, with the running
+// keystream. Compressed data is taken straight from the mapping or read from
+// the pack a chunk at a time. Output goes to `out' if it is not null (it must
+// hold size_orig bytes), otherwise to `sink' in pieces of at most
+// MABIPACK_STREAM_CHUNK bytes. Returns <0 on error.
+int MabiPack::decode_chunked(const file_info &entry, char *out, const sink_t *sink) const
+{
+	static const size_t CHUNK = MABIPACK_STREAM_CHUNK;
+
+	off_t src_off = sizeof (header_) + header_.fileinfo_size + (off_t)entry.offset;
+	if (map_ && (uint64_t)src_off + entry.size_compressed > map_size_) {
+		return -1;
+	}
+
+	uint32_t seed = (entry.seed << 7) ^ 0xa9c36de1;
+	KeystreamCache::stream_ptr stream;
+	if (ks_cache_) {
+		stream = ks_cache_->get(seed, entry.size_compressed);
+	}
+	mt_keystream ks(seed);
+
+	decode_scratch local;
+	decode_scratch &scratch = t_decode_scratch.busy ? local : t_decode_scratch;
+	scratch.busy = true;
+	decode_scratch_guard guard = { scratch };
+	int ret;
+	if (scratch.zs_ready) {
+		ret = inflateReset(&scratch.zs);
+	} else {
+		std::memset(&scratch.zs, 0, sizeof (scratch.zs));
+		ret = inflateInit(&scratch.zs);
+		scratch.zs_ready = ret == Z_OK;
+	}
+	if (ret != Z_OK) {
+		fprintf(stderr, "inflateInit: %d\n", ret);
+		return -1;
+	}
+	z_stream &zs = scratch.zs;
+
+	// key, input and (when streaming) output chunks
+	if (scratch.buf.size() < 3 * CHUNK) {
+		scratch.buf.resize(3 * CHUNK);
+	}
+	uint8_t *key = &scratch.buf[0];
+	uint8_t *chunk = &scratch.buf[CHUNK];
+	uint8_t *outchunk = out ? nullptr : &scratch.buf[2 * CHUNK];
+	if (out) {
+		zs.next_out = (Bytef *)out;
+		zs.avail_out = entry.size_orig;
+	}
+
+	ret = Z_OK;
+	for (size_t off = 0; off < entry.size_compressed && ret == Z_OK; off += CHUNK) {
+		size_t n = std::min(CHUNK, entry.size_compressed - off);
+		const uint8_t *src;
+		if (map_) {
+			src = (const uint8_t *)map_ + src_off + off;
+		} else {
+			if (pread_full(fd_, (char *)chunk, n, src_off + off) < 0) {
+				return -1;
+			}
+			src = chunk;
+		}
+		const uint8_t *k = key;
+		if (stream) {
+			k = stream->data() + off;
+		} else {
+			ks.keystream_bytes(key, n);
+		}
+		keystream_xor(chunk, src, k, n);
+		zs.next_in = chunk;
+		zs.avail_in = n;
+
+		if (out) {
+			ret = inflate(&zs, Z_NO_FLUSH);
+			if (ret == Z_BUF_ERROR && zs.avail_out == 0) {
+				// output is full; only an error if the stream does not end here.
+				break;
+			}
+			continue;
+		}
+		// Drain the output a chunk at a time.
+		do {
+			zs.next_out = outchunk;
+			zs.avail_out = CHUNK;
+			ret = inflate(&zs, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END) {
+				break;
+			}
+			size_t produced = CHUNK - zs.avail_out;
+			if (zs.total_out > entry.size_orig) {
+				ret = Z_DATA_ERROR;
+				break;
+			}
+			if (produced > 0 && (*sink)((const char *)outchunk, produced) < 0) {
+				return -2;
+			}
+		} while (ret == Z_OK && zs.avail_out == 0);
+		if (ret == Z_BUF_ERROR && zs.avail_in == 0) {
+			// no progress possible until more input arrives
+			ret = Z_OK;
+		}
+	}
+	uLong outlen = zs.total_out;
+	if (ret != Z_STREAM_END || outlen != entry.size_orig) {
+		fprintf(stderr, "uncompress: %d\n", ret == Z_OK ? Z_BUF_ERROR : ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+int MabiPack::readfile(const file_info &entry, const sink_t &sink) const
+{
+	assert(fd_ >= 0);
+
+	if (entry.size_compressed == 0 || !entry.is_compressed) {
+		return -1;
+	}
+	// Parallel decryption is not used here: it needs the whole entry in
+	// memory, which is what streaming avoids.
+	return decode_chunked(entry, nullptr, &sink);
+}
+
+int MabiPack::readfile(const file_info &entry, char *out, size_t size) const
 {
 	assert(fd_ >= 0);
 
 	if (entry.size_compressed == 0) {
-		return nullptr;
+		return -1;
 	}
 	if (!entry.is_compressed) {
 		// we do not support uncompressed files.
-		return nullptr;
+		return -1;
+	}
+	if (size < entry.size_orig) {
+		return -1;
 	}
 
-	uint32_t data_section_off = sizeof (header_) + header_.fileinfo_size;
-	off_t ret = ::lseek(fd_, data_section_off + entry.offset, SEEK_SET);
-	if (ret < 0) {
+	if (decrypt_threads_ <= 1 || entry.size_compressed < decrypt_threshold_) {
+		return decode_chunked(entry, out, nullptr) < 0 ? -1 : 0;
+	}
+
+	// Parallel decryption works in place, so it needs a private copy.
+	off_t data_section_off = sizeof (header_) + header_.fileinfo_size;
+	std::unique_ptr<char[]> compressed(new char[entry.size_compressed]);
+	if (map_) {
+		uint64_t end = (uint64_t)data_section_off + entry.offset + entry.size_compressed;
+		if (end > map_size_) {
+			return -1;
+		}
+		std::memcpy(compressed.get(), map_ + data_section_off + entry.offset, entry.size_compressed);
+	} else {
+		// Positional reads leave the file offset alone so that several threads can read at once.
+		if (pread_full(fd_, compressed.get(), entry.size_compressed, data_section_off + entry.offset) < 0) {
+			return -1;
+		}
+	}
+	return decode_file_contents(entry, compressed.get(), out);
+}
+
+MabiPack::buffer_t MabiPack::readfile(const file_info &entry) const
+{
+	if (entry.size_compressed == 0 || !entry.is_compressed) {
 		return nullptr;
 	}
-	char *compressed = new char[entry.size_compressed];
-	int nread = ::read(fd_, compressed, entry.size_compressed);
-	if (nread != (int)entry.size_compressed) {
-		delete[] compressed;
+	buffer_t data(new char[entry.size_orig]);
+	if (readfile(entry, data.get(), entry.size_orig) < 0) {
 		return nullptr;
 	}
+	return data;
+}
 
-	char *data = decode_file_contents(entry, compressed);
-	delete[] compressed;
+MabiPack::content_ptr MabiPack::read_cached(const file_info &entry) const
+{
+	if (content_cache_) {
+		content_ptr data = content_cache_->find(this, entry.offset);
+		if (data) {
+			return data;
+		}
+	}
+	if (entry.size_compressed == 0 || !entry.is_compressed) {
+		return nullptr;
+	}
+	std::shared_ptr<std::vector<char>> data(new std::vector<char>(entry.size_orig));
+	if (readfile(entry, data->data(), data->size()) < 0) {
+		return nullptr;
+	}
+	if (content_cache_) {
+		return content_cache_->insert(this, entry.offset, data);
+	}
 	return data;
 }
 
-char *MabiPack::readfile(const std::string &path)
+const file_info *MabiPack::find(const std::string &path) const
 {
-	return readfile(files_[path]);
+	const_cast<MabiPack *>(this)->load_index();
+	return files_.find(path);
+}
+
+bool MabiPack::lookup(const std::string &path, file_info &entry) const
+{
+	if (!index_loaded_.load(std::memory_order_acquire) && raw_index_) {
+		// The on-disk index stays around for lazily opened packs, so this
+		// is safe even if another thread is building the index.
+		return scan_index(path, entry);
+	}
+	const file_info *found = find(path);
+	if (!found) {
+		return false;
+	}
+	entry = *found;
+	return true;
+}
+
+void MabiPack::prefetch(uint64_t offset, uint64_t size) const
+{
+	assert(fd_ >= 0);
+
+	uint64_t start = sizeof (header_) + (uint64_t)header_.fileinfo_size + offset;
+	if (map_) {
+		if (start >= map_size_) {
+			return;
+		}
+		size = std::min(size, map_size_ - start);
+		uint64_t page = ::sysconf(_SC_PAGESIZE);
+		uint64_t aligned = start & ~(page - 1);
+		::madvise((void *)(map_ + aligned), size + (start - aligned), MADV_WILLNEED);
+	} else {
+		::posix_fadvise(fd_, start, size, POSIX_FADV_WILLNEED);
+	}
+}
+
+MabiPack::buffer_t MabiPack::readfile(const std::string &path) const
+{
+	file_info entry;
+	if (!lookup(path, entry)) {
+		return nullptr;
+	}
+	return readfile(entry);
 }
 
 
 MabiPackWriter::MabiPackWriter()
 	: fd_(-1)
+	, ks_cache_(nullptr)
+	, block_threshold_(0)
+	, block_threads_(1)
 {
 }
 
@@ -305,18 +983,74 @@ int MabiPackWriter::addfile(const std::string &path)
 {
 	assert(fd_ >= 0);
 
-	int seed = 0;
-	int ret;
+	if (path.size() > MABIPACK_MAX_FILENAME) {
+		errno = EINVAL;
+		return -7;
+	}
 
+	off_t offset = ::lseek(fd_, 0, SEEK_CUR);
+	if (offset < 0) {
+		return -6;
+	}
+
+	// The file is written to the pack as it is compressed. The compressed
+	// size is only known at the end; it is stored in files_ and written out
+	// by commit().
+	file_info info;
+	int ret = encode_file(path, [this](const char *data, size_t len) {
+		return write_full(fd_, data, len);
+	}, info);
+	if (ret < 0) {
+		return ret;
+	}
+
+	auto &entry = files_[next_idx_++];
+	entry.first = path;
+	entry.second = info;
+	entry.second.offset = offset - sizeof (header_) - header_.fileinfo_size;
+
+	return 0;
+}
+
+int MabiPackWriter::prepare_file(const std::string &path, prepared_file &out) const
+{
 	if (path.size() > MABIPACK_MAX_FILENAME) {
 		errno = EINVAL;
 		return -7;
 	}
 
+	out.path = path;
+	out.data.clear();
+	return encode_file(path, [&out](const char *data, size_t len) {
+		out.data.insert(out.data.end(), data, data + len);
+		return 0;
+	}, out.info);
+}
+
+int MabiPackWriter::append_prepared(const prepared_file &file)
+{
+	assert(fd_ >= 0);
+
 	off_t offset = ::lseek(fd_, 0, SEEK_CUR);
 	if (offset < 0) {
 		return -6;
 	}
+	if (write_full(fd_, file.data.data(), file.data.size()) < 0) {
+		return -5;
+	}
+
+	auto &entry = files_[next_idx_++];
+	entry.first = file.path;
+	entry.second = file.info;
+	entry.second.offset = offset - sizeof (header_) - header_.fileinfo_size;
+
+	return 0;
+}
+
+int MabiPackWriter::encode_file(const std::string &path, const MabiPack::sink_t &sink, file_info &info) const
+{
+	int seed = 0;
+	int ret;
 
 	int filefd = ::open(path.c_str(), O_RDONLY);
 	if (filefd < 0) {
@@ -326,64 +1060,61 @@ int MabiPackWriter::addfile(const std::string &path)
 	struct stat sb;
 	ret = ::fstat(filefd, &sb);
 	if (ret < 0) {
+		PreserveErrno pe;
+		::close(filefd);
 		return -8;
 	}
 
-	off_t filesize = ::lseek(filefd, 0, SEEK_END);
-	ret = ::lseek(filefd, 0, SEEK_SET);
-	if (filesize < 0 || ret < 0) {
-		{
-			PreserveErrno pe;
-			close(filefd);
-		}
-		return -2;
+	// The file is compressed and encrypted a chunk (or block) at a time so
+	// that memory use does not depend on the file size.
+	uint32_t key_seed = (seed << 7) ^ 0xa9c36de1;
+	KeystreamCache::stream_ptr stream;
+	if (ks_cache_) {
+		stream = ks_cache_->get(key_seed, compressBound(sb.st_size));
 	}
-
-	char *buf = new char[filesize];
-	ret = ::read(filefd, buf, filesize);
-	if (ret != filesize) {
-		{
-			PreserveErrno pe;
-			::close(filefd);
-			delete[] buf;
+	mt_keystream ks(key_seed);
+	uint64_t filesize = 0, complen = 0;
+	// Encrypts compressed data in place and passes it on.
+	auto emit = [&](char *data, size_t n) {
+		if (stream && complen + n > stream->size()) {
+			// The file grew since fstat(); continue with the generator.
+			ks.discard(complen);
+			stream.reset();
 		}
-		return -3;
-	}
-	::close(filefd);
+		if (stream) {
+			keystream_xor((uint8_t *)data, (const uint8_t *)data, stream->data() + complen, n);
+		} else {
+			ks.xor_bytes(data, n);
+		}
+		complen += n;
+		return sink(data, n);
+	};
 
-	uLongf complen = compressBound(filesize);
-	char *compbuf = new char[complen];
-	// TODO: Use streaming compression.
-	ret = compress2((Bytef *)compbuf, &complen, (const Bytef *)buf, filesize, 9);
-	delete[] buf;
-	if (ret != Z_OK) {
-		delete[] compbuf;
-		errno = EIO;
-		return -4;
+	if (block_threshold_ > 0 && (uint64_t)sb.st_size >= block_threshold_) {
+		filesize = sb.st_size;
+		ret = deflate_blocks(filefd, filesize, block_threads_, emit);
+	} else {
+		ret = deflate_file(filefd, filesize, emit);
 	}
-
-	mt19937ar mt((seed << 7) ^ 0xa9c36de1);
-	for (unsigned int i = 0; i < complen; i++) {
-		compbuf[i] ^= mt.genrand_int32();
+	{
+		PreserveErrno pe;
+		::close(filefd);
 	}
-
-	ret = ::write(fd_, compbuf, complen);
-	delete[] compbuf;
-	if (ret != (int)complen) {
-		return -5;
+	if (ret < 0) {
+		return ret;
+	}
+	if (filesize > UINT32_MAX || complen > UINT32_MAX) {
+		errno = EFBIG;
+		return -4;
 	}
 
-	auto &entry = files_[next_idx_++];
-	entry.first = path;
-	entry.second.seed = 0;
-	entry.second.zero = 0;
-	entry.second.offset = offset - sizeof (header_) - header_.fileinfo_size;
-	entry.second.size_orig = filesize;
-	entry.second.size_compressed = complen;
-	entry.second.is_compressed = 1;
-	entry.second.time1 = entry.second.time2 = entry.second.time4 = entry.second.time5
-		= creation_filetime_;
-	entry.second.time3 = unix_ts_to_filetime(sb.st_mtime);
+	std::memset(&info, 0, sizeof (info));
+	info.seed = seed;
+	info.size_orig = filesize;
+	info.size_compressed = complen;
+	info.is_compressed = 1;
+	info.time1 = info.time2 = info.time4 = info.time5 = creation_filetime_;
+	info.time3 = unix_ts_to_filetime(sb.st_mtime);
 
 	return 0;
 }
@@ -9,6 +9,26 @@ static const int MABIPACK_MAX_FILENAME_STORAGE = 256;
 // Subtract the size for filename_encoding_method(\x05), filename_length and null_terminator.
 static const int MABIPACK_MAX_FILENAME = MABIPACK_MAX_FILENAME_STORAGE - (1 + 4 + 1);
 
+// MabiPack::openpack flags
+// Map the whole pack and decode entries straight from the mapping instead of read(2).
+static const int MABIPACK_OPEN_MMAP = 0x1;
+// Access pattern hints for MABIPACK_OPEN_MMAP.
+static const int MABIPACK_ADVISE_SEQUENTIAL = 0x2;
+static const int MABIPACK_ADVISE_RANDOM = 0x4;
+// Only validate the header at open time. The file index is built on first
+// iteration or find(); until then lookup() and readfile(path) scan the
+// on-disk index in place.
+static const int MABIPACK_OPEN_LAZY = 0x8;
+// Reuse the file index saved in a sidecar file (<pack>.idx) if it matches
+// the pack's size, mtime and version; otherwise build the index and
+// (re)write the sidecar.
+static const int MABIPACK_OPEN_INDEX_CACHE = 0x10;
+
+// Size of the pieces MabiPack::readfile hands to a sink.
+static const size_t MABIPACK_STREAM_CHUNK = 256 * 1024;
+// Input block size of MabiPackWriter's block parallel deflate.
+static const size_t MABIPACK_DEFLATE_BLOCK = 1024 * 1024;
+
 struct package_header
 {
 	char magic[4];
@@ -35,35 +55,115 @@ struct file_info
 	uint64_t time1, time2, time3, time4, time5;
 };
 
+#include "packindex.h"
+#include "dirtree.h"
+
+class KeystreamCache;
+class ContentCache;
+
 class MabiPack
 {
 public:
-	typedef std::map<std::string, file_info> filelist_t;
+	typedef PackIndex filelist_t;
+	// Receives decoded file contents piece by piece. Returns <0 to abort.
+	typedef std::function<int(const char *data, size_t len)> sink_t;
+	// Owns a decoded file.
+	typedef std::unique_ptr<char[]> buffer_t;
+	// Shares a decoded file with a ContentCache.
+	typedef std::shared_ptr<const std::vector<char>> content_ptr;
 
 public:
 	MabiPack();
 	~MabiPack();
 
-	int openpack(const std::string &path);
+	int openpack(const std::string &path, int flags=0);
 	int closepack();
-	char *readfile(const std::string &path);
-	char *readfile(const file_info &entry);
+	// Lookup and read functions are const and do not touch shared state
+	// other than through pread(2), so any number of threads may call them
+	// on the same pack concurrently.
+	// Builds the index first if the pack was opened with MABIPACK_OPEN_LAZY.
+	const file_info *find(const std::string &path) const;
+	// Copies the entry for `path' to `entry'. Does not build a lazy index.
+	bool lookup(const std::string &path, file_info &entry) const;
+	// Returns nullptr if the file is not in the pack or cannot be read.
+	buffer_t readfile(const std::string &path) const;
+	buffer_t readfile(const file_info &entry) const;
+	// Decodes `entry' into `out', which holds `size' bytes; at least
+	// entry.size_orig are needed. Working buffers are kept per thread and
+	// reused, so this allocates nothing in a loop except for entries that
+	// are decrypted in parallel. Returns <0 on error.
+	int readfile(const file_info &entry, char *out, size_t size) const;
+	// Like readfile(entry), but goes through the content cache if one is
+	// set: repeated reads of an entry return the same decoded copy.
+	// Returns nullptr on error.
+	content_ptr read_cached(const file_info &entry) const;
+	// Streams the decoded contents of `entry' to `sink' while decrypting and
+	// inflating, using a fixed amount of memory regardless of the file size.
+	// Entries are never decrypted in parallel here.
+	int readfile(const file_info &entry, const sink_t &sink) const;
+	// Tells the kernel that the data section bytes [offset, offset + size)
+	// will be read soon, so that it can start reading them in the background.
+	void prefetch(uint64_t offset, uint64_t size) const;
 
 	const package_header &header() const { return header_; }
+	// Use `cache' for entry keystreams. nullptr disables caching. The cache is not owned.
+	void set_keystream_cache(KeystreamCache *cache) { ks_cache_ = cache; }
+	// Use `cache' for read_cached(). nullptr disables caching. The cache is
+	// not owned; closepack() drops this pack's entries from it.
+	void set_content_cache(ContentCache *cache) { content_cache_ = cache; }
+	// Decrypt entries of at least `threshold' compressed bytes with `nthreads' threads
+	// when they are decoded whole; streaming readfile() always decrypts on one.
+	void set_parallel_decrypt(int nthreads, uint32_t threshold)
+	{
+		decrypt_threads_ = nthreads;
+		decrypt_threshold_ = threshold;
+	}
 
-	filelist_t::iterator begin() { return files_.begin(); }
-	filelist_t::iterator end() { return files_.end(); }
-	filelist_t::const_iterator begin() const { return files_.begin(); }
-	filelist_t::const_iterator end() const { return files_.end(); }
+	// Builds the file index if it was not built yet. Returns <0 if it is corrupt.
+	int load_index();
+	// Frees the file index; it is built again from the pack when needed.
+	// readfile(const file_info &) keeps working without it.
+	// Must not be called while other threads use the pack.
+	void release_index();
+
+	// Iterates over entries in name order.
+	filelist_t::const_iterator begin() const { return files().begin(); }
+	filelist_t::const_iterator end() const { return files().end(); }
+	const filelist_t &files() const
+	{
+		const_cast<MabiPack *>(this)->load_index();
+		return files_;
+	}
+	// files() with the lowercase name column (PackIndex::fold) built.
+	const filelist_t &folded_files() const;
+	// Directory tree over folded_files(), built on first use.
+	const DirTree &dir_tree() const;
 
 private:
-	filelist_t::value_type read_fileinfo(int fd);
-	char *decode_file_contents(const file_info &entry, char *compressed);
+	int read_raw_index(std::vector<char> &buf, const char *&p, size_t &size) const;
+	int parse_fileinfo(const char *&p, const char *end);
+	bool scan_index(const std::string &path, file_info &entry) const;
+	int decode_file_contents(const file_info &entry, char *compressed, char *out) const;
+	int decode_chunked(const file_info &entry, char *out, const sink_t *sink) const;
 
 private:
 	int fd_;
 	package_header header_;
 	filelist_t files_;
+	DirTree dirs_;
+	KeystreamCache *ks_cache_;
+	ContentCache *content_cache_;
+	int decrypt_threads_;
+	uint32_t decrypt_threshold_;
+	// Set if opened with MABIPACK_OPEN_MMAP.
+	const char *map_;
+	size_t map_size_;
+	// The on-disk file index. Only kept for lazily opened packs.
+	const char *raw_index_;
+	size_t raw_index_size_;
+	std::vector<char> raw_index_buf_;
+	std::atomic<bool> index_loaded_;
+	mutable std::mutex index_lock_;
 };
 
 class MabiPackWriter
@@ -75,12 +175,40 @@ public:
 	int open(const std::string &path, uint32_t version, int filecnt, const char *mountpoint="data\\");
 	// Returns <0 on error and errno is set appropriately.
 	int addfile(const std::string &path);
+
+	// A file compressed and encrypted by prepare_file(), waiting to be appended.
+	struct prepared_file
+	{
+		std::string path;
+		file_info info;
+		std::vector<char> data;
+	};
+	// Does the work of addfile() short of writing to the pack, keeping the
+	// encoded file in memory. Safe to call from several threads at once.
+	// Returns <0 on error and errno is set appropriately.
+	int prepare_file(const std::string &path, prepared_file &out) const;
+	// Appends a file from prepare_file(). Appending files in the order they
+	// would have been passed to addfile() produces an identical pack.
+	// Returns <0 on error and errno is set appropriately.
+	int append_prepared(const prepared_file &file);
 	// Returns <0 on error and errno is set appropriately.
 	int commit();
 	void discard();
+	// Use `cache' for entry keystreams. nullptr disables caching. The cache is not owned.
+	void set_keystream_cache(KeystreamCache *cache) { ks_cache_ = cache; }
+	// Files of at least `threshold' bytes are split into MABIPACK_DEFLATE_BLOCK
+	// sized blocks that are deflated on `nthreads' threads and joined into a
+	// single zlib stream. The compressed data differs from a plain deflate
+	// but does not depend on `nthreads'. A threshold of 0 disables this.
+	void set_block_deflate(uint64_t threshold, int nthreads)
+	{
+		block_threshold_ = threshold;
+		block_threads_ = nthreads;
+	}
 
 private:
 	int write_filename(const char *name);
+	int encode_file(const std::string &path, const MabiPack::sink_t &sink, file_info &info) const;
 
 private:
 	int fd_;
@@ -88,6 +216,9 @@ private:
 	package_header header_;
 	std::vector<std::pair<std::string, file_info>> files_;
 	uint64_t creation_filetime_;
+	KeystreamCache *ks_cache_;
+	uint64_t block_threshold_;
+	int block_threads_;
 };
 
 // Utility class. todo: move this to somewhere else.
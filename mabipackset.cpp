@@ -0,0 +1,135 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include <cstring>
+#include <cstdint>
+#include <errno.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+#include "mabipack.h"
+#include "mabipackset.h"
+
+
+MabiPackSet::MabiPackSet()
+{
+}
+
+MabiPackSet::~MabiPackSet()
+{
+	close();
+}
+
+int MabiPackSet::open(const std::string &dir, int flags)
+{
+	int ret = adddir(dir, flags);
+	if (ret < 0) {
+		close();
+		return ret;
+	}
+	return build();
+}
+
+int MabiPackSet::adddir(const std::string &dir, int flags)
+{
+	DIR *dp = ::opendir(dir.c_str());
+	if (!dp) {
+		return -1;
+	}
+	std::vector<std::string> paths;
+	struct dirent *entry;
+	while ((entry = ::readdir(dp)) != NULL) {
+		size_t len = ::strlen(entry->d_name);
+		if (len > 5 && !::strcmp(entry->d_name + len - 5, ".pack")) {
+			paths.push_back(dir + "/" + entry->d_name);
+		}
+	}
+	::closedir(dp);
+	std::sort(paths.begin(), paths.end());
+
+	for (const std::string &path : paths) {
+		int ret = addpack(path, flags);
+		if (ret < 0) {
+			return -2;
+		}
+	}
+	return 0;
+}
+
+int MabiPackSet::addpack(const std::string &path, int flags)
+{
+	pack_slot slot;
+	slot.path = path;
+	slot.pack.reset(new MabiPack());
+	int ret = slot.pack->openpack(path, flags);
+	if (ret < 0) {
+		return ret;
+	}
+	packs_.push_back(slot);
+	return 0;
+}
+
+int MabiPackSet::build()
+{
+	// Highest priority first: PackIndex keeps the first copy of a name.
+	std::stable_sort(packs_.begin(), packs_.end(), [](const pack_slot &a, const pack_slot &b) {
+		uint32_t va = a.pack->header().version, vb = b.pack->header().version;
+		return va > vb || (va == vb && a.path > b.path);
+	});
+
+	files_.clear();
+	for (size_t i = 0; i < packs_.size(); i++) {
+		MabiPack &pack = *packs_[i].pack;
+		if (pack.load_index() < 0) {
+			return -1;
+		}
+		for (const auto &entry : pack.files()) {
+			files_.add(entry.first.data(), entry.first.size(), entry.second, i);
+		}
+		// Only the merged index is needed from now on.
+		pack.release_index();
+	}
+	files_.finish();
+	return 0;
+}
+
+void MabiPackSet::close()
+{
+	files_.clear();
+	packs_.clear();
+}
+
+const file_info *MabiPackSet::find(const std::string &path, size_t *pack) const
+{
+	const PackIndex::entry *ent = files_.find_entry(path.data(), path.size());
+	if (!ent) {
+		return nullptr;
+	}
+	if (pack) {
+		*pack = ent->tag;
+	}
+	return &ent->info;
+}
+
+MabiPack::buffer_t MabiPackSet::readfile(const std::string &path) const
+{
+	size_t pack;
+	const file_info *entry = find(path, &pack);
+	if (!entry) {
+		return nullptr;
+	}
+	return packs_[pack].pack->readfile(*entry);
+}
+
+MabiPack::buffer_t MabiPackSet::readfile(const filelist_t::value_type &entry) const
+{
+	return packs_[entry.tag].pack->readfile(entry.second);
+}
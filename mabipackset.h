@@ -0,0 +1,56 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+#pragma once
+
+// A set of packs seen as one file tree, the way the game client sees them:
+// when several packs contain the same path, the copy in the pack with the
+// highest header version wins. Packs with equal versions are ordered by path.
+// The merged index records the winning pack for every path; the per-pack
+// indexes are released once merged, so only the merged one stays in memory.
+class MabiPackSet
+{
+public:
+	typedef PackIndex filelist_t;
+
+public:
+	MabiPackSet();
+	~MabiPackSet();
+
+	// Opens every *.pack file in `dir' and builds the merged index.
+	// `flags' are passed to MabiPack::openpack. Returns <0 on error.
+	int open(const std::string &dir, int flags=0);
+	// Alternatively, add packs one by one or by directory and call build().
+	int addpack(const std::string &path, int flags=0);
+	int adddir(const std::string &dir, int flags=0);
+	int build();
+	void close();
+
+	// Returns nullptr if no pack contains `path'. If `pack' is not null it
+	// is set to the number of the winning pack.
+	const file_info *find(const std::string &path, size_t *pack=nullptr) const;
+	MabiPack::buffer_t readfile(const std::string &path) const;
+	MabiPack::buffer_t readfile(const filelist_t::value_type &entry) const;
+
+	size_t pack_count() const { return packs_.size(); }
+	const MabiPack &pack(size_t i) const { return *packs_[i].pack; }
+	MabiPack &pack(size_t i) { return *packs_[i].pack; }
+	const std::string &pack_path(size_t i) const { return packs_[i].path; }
+	// Pack number of an entry returned by iteration.
+	static size_t pack_of(const filelist_t::value_type &entry) { return entry.tag; }
+
+	// Iterates over the winning entries in name order.
+	filelist_t::const_iterator begin() const { return files_.begin(); }
+	filelist_t::const_iterator end() const { return files_.end(); }
+	const filelist_t &files() const { return files_; }
+
+private:
+	struct pack_slot
+	{
+		std::string path;
+		std::shared_ptr<MabiPack> pack;
+	};
+
+private:
+	std::vector<pack_slot> packs_;
+	filelist_t files_;
+};
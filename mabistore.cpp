@@ -0,0 +1,256 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "mabipack.h"
+#include "mabipackset.h"
+#include "mabistore.h"
+#include "workqueue.h"
+#include "fileutil.h"
+
+
+// Start of a store blob. File contents follow, each aligned to 8 bytes;
+// entry offsets in the index are relative to the start of the blob.
+struct mabistore_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t filecnt;
+	// Size of the whole blob.
+	uint64_t size;
+};
+
+static const char MABISTORE_MAGIC[8] = {'M', 'A', 'B', 'I', 'S', 'T', 'O', '1'};
+
+static pack_index_key store_index_key(const struct stat &sb, uint32_t filecnt)
+{
+	pack_index_key key;
+	std::memset(&key, 0, sizeof (key));
+	key.pack_size = sb.st_size;
+	key.pack_mtime_sec = sb.st_mtim.tv_sec;
+	key.pack_mtime_nsec = sb.st_mtim.tv_nsec;
+	key.pack_version = MABISTORE_VERSION;
+	key.filecnt = filecnt;
+	return key;
+}
+
+
+MabiStore::MabiStore()
+	: map_(nullptr)
+	, map_size_(0)
+{
+}
+
+MabiStore::~MabiStore()
+{
+	close();
+}
+
+int MabiStore::open(const std::string &path)
+{
+	close();
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	struct stat sb;
+	if (::fstat(fd, &sb) < 0) {
+		::close(fd);
+		return -1;
+	}
+	if (sb.st_size < (off_t)sizeof (mabistore_header)) {
+		::close(fd);
+		return -2;
+	}
+	void *map = ::mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	map_ = (const char *)map;
+	map_size_ = sb.st_size;
+
+	mabistore_header hdr;
+	std::memcpy(&hdr, map_, sizeof (hdr));
+	if (std::memcmp(hdr.magic, MABISTORE_MAGIC, sizeof (hdr.magic)) != 0
+		|| hdr.version != MABISTORE_VERSION || hdr.size != map_size_) {
+		close();
+		return -2;
+	}
+	if (files_.load(path + ".idx", store_index_key(sb, hdr.filecnt)) < 0 || files_.size() != hdr.filecnt) {
+		close();
+		return -3;
+	}
+	for (const auto &entry : files_) {
+		uint64_t offset = blob_offset(entry.second);
+		if (offset < sizeof (hdr) || offset + entry.second.size_orig > map_size_) {
+			close();
+			return -3;
+		}
+	}
+	return 0;
+}
+
+void MabiStore::close()
+{
+	files_.clear();
+	if (map_) {
+		::munmap((void *)map_, map_size_);
+		map_ = nullptr;
+		map_size_ = 0;
+	}
+}
+
+const char *MabiStore::find(const char *path, size_t len, size_t *size) const
+{
+	const PackIndex::entry *ent = files_.find_entry(path, len);
+	if (!ent) {
+		return nullptr;
+	}
+	*size = ent->info.size_orig;
+	return data(ent->info);
+}
+
+int MabiStore::create(const std::string &path, const MabiPackSet &packs, int nthreads,
+	const std::function<void(const pack_name &name)> &progress)
+{
+	const PackIndex &files = packs.files();
+	// Read every pack front to back.
+	std::vector<uint32_t> order(files.size());
+	size_t name_bytes = 0;
+	for (size_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+		name_bytes += files.at(i).first.size() + 1;
+	}
+	std::sort(order.begin(), order.end(), [&files](uint32_t a, uint32_t b) {
+		PackIndex::value_type x = files.at(a), y = files.at(b);
+		if (x.tag != y.tag) {
+			return x.tag < y.tag;
+		}
+		return x.second.offset < y.second.offset;
+	});
+
+	ReplaceFile file;
+	if (file.open(path) < 0) {
+		return -1;
+	}
+	int fd = file.fd();
+
+	// The header is filled in once everything else is written.
+	std::vector<char> buf(sizeof (mabistore_header), 0);
+	buf.reserve(MABISTORE_WRITE_BUFFER);
+	uint64_t size = sizeof (mabistore_header);
+	auto append = [&](const char *data, size_t len) {
+		size += len;
+		while (len > 0) {
+			size_t n = std::min(len, MABISTORE_WRITE_BUFFER - buf.size());
+			buf.insert(buf.end(), data, data + n);
+			data += n;
+			len -= n;
+			if (buf.size() == MABISTORE_WRITE_BUFFER) {
+				if (write_full(fd, buf.data(), buf.size()) < 0) {
+					return -1;
+				}
+				buf.clear();
+			}
+		}
+		return 0;
+	};
+
+	PackIndex index;
+	index.reserve(files.size(), name_bytes);
+	std::vector<MabiPack::buffer_t> decoded(order.size());
+	int error = 0;
+	run_ordered(order.size(), nthreads, std::max(nthreads, 1) * 2,
+		[&](size_t k) {
+			PackIndex::value_type entry = files.at(order[k]);
+			if (entry.second.size_orig > MABISTORE_STREAM_THRESHOLD) {
+				return 0;
+			}
+			decoded[k] = packs.readfile(entry);
+			return decoded[k] ? 0 : -1;
+		},
+		[&](size_t k, int ret) {
+			PackIndex::value_type entry = files.at(order[k]);
+			file_info info = entry.second;
+			info.offset = (uint32_t)size;
+			info.zero = (uint32_t)(size >> 32);
+			if (ret < 0) {
+				error = EIO;
+			} else if (decoded[k]) {
+				if (append(decoded[k].get(), info.size_orig) < 0) {
+					error = errno;
+				}
+				decoded[k].reset();
+			} else {
+				ret = packs.pack(entry.tag).readfile(entry.second, append);
+				if (ret < 0) {
+					// -2: the sink, and so write(2), failed.
+					error = ret == -2 ? errno : EIO;
+				}
+			}
+			static const char zeros[8] = {0};
+			if (!error && append(zeros, (8 - size % 8) % 8) < 0) {
+				error = errno;
+			}
+			if (error) {
+				return false;
+			}
+			index.add(entry.first.data(), entry.first.size(), info);
+			if (progress) {
+				progress(entry.first);
+			}
+			return true;
+		});
+	if (!error && write_full(fd, buf.data(), buf.size()) < 0) {
+		error = errno;
+	}
+	if (error) {
+		file.discard();
+		errno = error;
+		return -2;
+	}
+
+	mabistore_header hdr;
+	std::memset(&hdr, 0, sizeof (hdr));
+	std::memcpy(hdr.magic, MABISTORE_MAGIC, sizeof (hdr.magic));
+	hdr.version = MABISTORE_VERSION;
+	hdr.filecnt = order.size();
+	hdr.size = size;
+	if (::pwrite(fd, &hdr, sizeof (hdr), 0) != (ssize_t)sizeof (hdr)) {
+		return -2;
+	}
+	if (file.commit() < 0) {
+		return -3;
+	}
+
+	// A stale index no longer matches the new blob's mtime, so the store is
+	// never seen with the wrong index.
+	struct stat sb;
+	if (::stat(path.c_str(), &sb) < 0) {
+		return -5;
+	}
+	index.finish();
+	if (index.save(path + ".idx", store_index_key(sb, hdr.filecnt)) < 0) {
+		return -6;
+	}
+	return 0;
+}
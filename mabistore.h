@@ -0,0 +1,60 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+#pragma once
+
+// Version of the store format.
+static const uint32_t MABISTORE_VERSION = 1;
+// MabiStore::create() writes the blob in pieces of this size.
+static const size_t MABISTORE_WRITE_BUFFER = 8 * 1048576;
+// Entries larger than this are streamed into the blob instead of being
+// decoded on worker threads.
+static const uint32_t MABISTORE_STREAM_THRESHOLD = 8 * 1048576;
+
+// Local store of decoded pack contents.
+// A store is a blob file holding every file decrypted and inflated, back
+// to back, plus a saved PackIndex next to it (<store>.idx) whose entries
+// point into the blob. Opening maps both, so lookups cost a hash probe and
+// return pointers straight into the mapping: reading a file from a warm
+// store does no decryption, inflation or copying.
+class MabiStore
+{
+public:
+	typedef PackIndex filelist_t;
+
+public:
+	MabiStore();
+	~MabiStore();
+
+	// Returns <0 on error; -2 if the blob is not a store and -3 if its
+	// index is missing or does not belong to it.
+	int open(const std::string &path);
+	void close();
+
+	// Returns a view of the contents of `path', valid until close(), and
+	// sets `*size'. Returns nullptr if the file is not in the store.
+	const char *find(const char *path, size_t len, size_t *size) const;
+	const char *find(const std::string &path, size_t *size) const { return find(path.data(), path.size(), size); }
+	// Contents of an entry returned by iteration; entry.size_orig bytes long.
+	const char *data(const file_info &entry) const { return map_ + blob_offset(entry); }
+	// In a store's index, file_info::offset and file_info::zero hold the low
+	// and high halves of the entry's 64-bit offset in the blob.
+	static uint64_t blob_offset(const file_info &entry) { return (uint64_t)entry.zero << 32 | entry.offset; }
+
+	// Iterates over entries in name order.
+	filelist_t::const_iterator begin() const { return files_.begin(); }
+	filelist_t::const_iterator end() const { return files_.end(); }
+	const filelist_t &files() const { return files_; }
+
+	// Writes the contents of `packs' to a new store at `path', replacing any
+	// existing one. Entries are decoded on `nthreads' threads and written
+	// out in large sequential writes. `progress' is called for every file
+	// written if it is set.
+	// Returns <0 on error and errno is set appropriately.
+	static int create(const std::string &path, const MabiPackSet &packs, int nthreads,
+		const std::function<void(const pack_name &name)> &progress=nullptr);
+
+private:
+	const char *map_;
+	size_t map_size_;
+	filelist_t files_;
+};
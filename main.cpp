@@ -6,7 +6,14 @@
 #include <vector>
 #include <map>
 #include <set>
-#include <sstream>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <condition_variable>
+#include <functional>
 
 #include <string.h>
 #include <inttypes.h>
@@ -20,7 +27,13 @@
 #include <dirent.h>
 
 #include "mabipack.h"
-#include "wildcard.h"
+#include "mabipackset.h"
+#include "keystream.h"
+#include "patternset.h"
+#include "workqueue.h"
+#include "outputtree.h"
+#include "writeback.h"
+#include "mabistore.h"
 
 
 // utilities
@@ -38,87 +51,202 @@ const char *format_filetime(uint64_t filetime)
 	return buf;
 }
 
-static bool check_patterns(const std::vector<const char *> &patterns, const std::string &name)
+// Unless `mtime' is -1 the modification time of the file is set to it.
+static int extract_file(OutputTree &out, const MabiPack &pack, const char *name, const file_info &entry, int64_t mtime)
 {
-	if (patterns.empty()) {
-		return true;
+	int fd = out.create(name, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if (fd < 0) {
+		if (fd == -3) {
+			perror("mkdir");
+		} else if (fd != -2) {
+			// -2: there were invalid characters in filename.
+			perror("open");
+		}
+		return -1;
+	}
+
+	// Decoded data is written as it is produced, so memory use does not
+	// depend on the file size.
+	int nwrite = 0;
+	int ret = pack.readfile(entry, [&](const char *data, size_t len) {
+		size_t done = 0;
+		while (done < len) {
+			nwrite = write(fd, data + done, len - done);
+			if (nwrite <= 0) {
+				return -1;
+			}
+			done += nwrite;
+		}
+		return 0;
+	});
+	if (ret == -2) {
+		if (nwrite < 0) {
+			perror("write");
+		} else {
+			fprintf(stderr, "short write: %d\n", nwrite);
+		}
+		close(fd);
+		out.unlink(name);
+		return -1;
+	} else if (ret < 0) {
+		close(fd);
+		out.unlink(name);
+		fprintf(stderr, "Cannot extract file: %s\n", name);
+		return -1;
 	}
-	for (const char *pattern : patterns) {
-		if (wc_match_nocase(pattern, name.c_str())) {
-			return true;
+	if (mtime != -1) {
+		struct timespec times[2] = { { 0, UTIME_OMIT }, { (time_t)mtime, 0 } };
+		if (futimens(fd, times) < 0) {
+			perror("futimens");
+			close(fd);
+			out.unlink(name);
+			return -1;
 		}
 	}
-	return false;
+
+	close(fd);
+	return 0;
 }
 
-static void str_split(std::vector<std::string> &out, const std::string &str, char delim)
+// Decodes a file into memory and queues it on `writeback'. Errors while
+// writing it are reported through the writeback callback with `token'.
+static int extract_file_async(OutputTree &out, WriteBack &writeback, const MabiPack &pack,
+	const char *name, const file_info &entry, int64_t mtime, uint64_t token)
 {
-	std::stringstream ss(str);
-	std::string buf;
-	while (std::getline(ss, buf, delim)) {
-		out.push_back(buf);
+	const char *base;
+	int dirfd = out.parent_of(name, &base);
+	if (dirfd < 0) {
+		if (dirfd == -3) {
+			perror("mkdir");
+		} else if (dirfd != -2) {
+			// -2: there were invalid characters in filename.
+			perror("open");
+		}
+		return -1;
+	}
+
+	MabiPack::buffer_t data = pack.readfile(entry);
+	if (!data) {
+		fprintf(stderr, "Cannot extract file: %s\n", name);
+		return -1;
 	}
+	writeback.submit(dirfd, base, data.release(), entry.size_orig, mtime, token);
+	return 0;
 }
 
-static int mkdir_recursive(const std::string &path, bool ignore_last_elem=false)
+// Whether the output file of `name' already has the size and modification
+// time recorded for `entry', so that sync mode can skip it.
+static bool output_is_current(OutputTree &out, const char *name, const file_info &entry)
 {
-	std::vector<std::string> elems;
-	str_split(elems, path, '/');
-	std::string buf("./");
-	for (auto it = elems.begin(); it != elems.end(); ++it) {
-		std::string &elem = *it;
-		if (elem == "..") {
-			return -1;
-		}
-		if (ignore_last_elem && (it + 1 == elems.end())) {
-			break;
-		}
-		buf += elem + "/";
-		int ret = mkdir(buf.c_str(), 0755);
-		if (ret != 0 && errno != EEXIST) {
-			perror("mkdir");
-			return -1;
+	const char *base;
+	int dirfd = out.parent_of(name, &base);
+	struct stat sb;
+	return dirfd >= 0 && fstatat(dirfd, base, &sb, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(sb.st_mode)
+		&& (uint64_t)sb.st_size == entry.size_orig && sb.st_mtime == filetime_to_unix_ts(entry.time3);
+}
+
+// `name' the way remove_stale_files() spells the same path.
+static std::string normalize_path(const char *name)
+{
+	std::string path;
+	while (*name) {
+		const char *end = strchrnul(name, '/');
+		size_t len = end - name;
+		if (len > 0 && !(len == 1 && name[0] == '.')) {
+			if (!path.empty()) {
+				path += '/';
+			}
+			path.append(name, len);
 		}
+		name = *end ? end + 1 : end;
 	}
-	return 0;
+	return path;
 }
 
-static int extract_file(MabiPack &pack, const std::string &name, const file_info &entry)
+// Removes regular files below `dir' (relative to the current directory)
+// that match `patterns' but are not in `keep'. With `dry_run' they are only
+// listed. Returns the number of files removed, or <0 on error.
+static long remove_stale_files(const std::string &dir, const std::set<std::string> &keep,
+	const PatternSet &patterns, bool dry_run)
 {
-	int ret = mkdir_recursive(name, true);
-	if (ret < 0) {
-		// failed to make directory or there were invalid characters in filename.
+	DIR *dp = opendir(dir.c_str());
+	if (!dp) {
+		fprintf(stderr, "ERROR: Cannot open directory %s: %s\n", dir.c_str(), strerror(errno));
 		return -1;
 	}
 
-	int fd = open(name.c_str(), O_CREAT | O_WRONLY, 0644);
-	if (fd < 0) {
-		perror("open");
-		return -1;
+	long removed = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dp)) != NULL) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+			continue;
+		}
+		std::string path = dir.empty() ? std::string(entry->d_name) : dir + "/" + entry->d_name;
+		struct stat sb;
+		if (lstat(path.c_str(), &sb) < 0) {
+			continue;
+		}
+		if (S_ISDIR(sb.st_mode)) {
+			long ret = remove_stale_files(path, keep, patterns, dry_run);
+			if (ret < 0) {
+				closedir(dp);
+				return ret;
+			}
+			removed += ret;
+		} else if (S_ISREG(sb.st_mode) && !keep.count(path) && patterns.match(path.c_str())) {
+			if (dry_run) {
+				printf("Would remove stale file %s\n", path.c_str());
+				removed++;
+				continue;
+			}
+			if (unlink(path.c_str()) < 0) {
+				fprintf(stderr, "ERROR: Cannot remove %s: %s\n", path.c_str(), strerror(errno));
+				closedir(dp);
+				return -1;
+			}
+			printf("Removed stale file %s\n", path.c_str());
+			removed++;
+		}
 	}
+	closedir(dp);
+	return removed;
+}
 
-	char *data = pack.readfile(entry);
-	if (data == nullptr) {
-		close(fd);
-		unlink(name.c_str());
-		fprintf(stderr, "Cannot extract file: %s\n", name.c_str());
+// Adds the absolute paths of the pack `path' and of its index sidecar, if
+// there is one, to `inputs'.
+static void add_input_files(const char *path, std::vector<std::string> &inputs)
+{
+	std::string sidecar = std::string(path) + ".idx";
+	for (const char *p : { path, sidecar.c_str() }) {
+		char *abs = realpath(p, NULL);
+		if (abs) {
+			inputs.push_back(abs);
+			free(abs);
+		}
+	}
+}
+
+// -D only looks below the output directory, but it must never get a chance
+// to remove the packs being extracted. Returns <0 if the current (output)
+// directory holds any of `inputs'.
+static int check_stale_removal(const std::vector<std::string> &inputs)
+{
+	char *cwd = realpath(".", NULL);
+	if (!cwd) {
+		perror("realpath");
 		return -1;
 	}
-	int nwrite = write(fd, data, entry.size_orig);
-	if (nwrite != (int)entry.size_orig) {
-		if (nwrite < 0) {
-			perror("write");
-		} else {
-			fprintf(stderr, "short write: %d, %d\n", nwrite, entry.size_orig);
+	std::string dir = cwd;
+	free(cwd);
+	if (dir != "/") {
+		dir += '/';
+	}
+	for (const std::string &input : inputs) {
+		if (!input.compare(0, dir.size(), dir)) {
+			fprintf(stderr, "ERROR: Refusing to remove stale files: the output directory holds %s\n", input.c_str());
+			return -1;
 		}
-		close(fd);
-		unlink(name.c_str());
-		delete[] data;
-		return -1;
 	}
-
-	close(fd);
-	delete[] data;
 	return 0;
 }
 
@@ -126,57 +254,454 @@ static int extract_file(MabiPack &pack, const std::string &name, const file_info
 static const char *g_program_name;
 static const char *g_packfile;
 static std::vector<const char *> g_arglist;
+static size_t g_keystream_cache_mb = 32;
+static bool g_print_keystream_stats = false;
+static int g_jobs = 1;
+static bool g_use_mmap = true;
+static bool g_use_index_cache = false;
+static bool g_print_sorted = false;
+static bool g_sync = false;
+static bool g_remove_stale = false;
+// -R: only list the files -D would remove
+static bool g_remove_dry_run = false;
+// -T: file with one path to select per line
+static const char *g_list_file;
+// -S: store to create
+static const char *g_store_path;
+// Entries larger than this are decrypted on all cores.
+static const uint32_t PARALLEL_DECRYPT_THRESHOLD = 64 * 1048576;
 // extract only
 static const char *g_extract_dir = "./";
+// Extraction prefetches the pack in windows of about this many bytes.
+static const uint64_t EXTRACT_READAHEAD = 8 * 1048576;
+// Unselected data longer than this between two entries is not prefetched.
+static const uint64_t EXTRACT_READAHEAD_MAX_GAP = 1048576;
+// Files up to this size are decoded into memory and written in the
+// background; larger ones are streamed to disk by the extracting thread.
+static const uint32_t WRITEBACK_MAX_FILE = 1048576;
+// Decoded bytes waiting to be written at most.
+static const size_t WRITEBACK_MAX_INFLIGHT = 64 * 1048576;
 // create only
 static int g_pack_version = 0;
 static const char *g_pack_mountpoint = "data\\";
+static bool g_block_deflate = false;
+// Files larger than this are compressed on all cores with -P.
+static const uint64_t BLOCK_DEFLATE_THRESHOLD = 64 * 1048576;
+// With -j, files at least this large are not encoded on the workers but
+// written straight into the pack, so that they are never held in memory,
+// and compressed in blocks on -j threads (all cores with -P) meanwhile.
+static const uint64_t CREATE_STREAM_THRESHOLD = 8 * 1048576;
+
+static KeystreamCache *keystream_cache()
+{
+	static std::unique_ptr<KeystreamCache> cache;
+	if (!cache && g_keystream_cache_mb > 0) {
+		cache.reset(new KeystreamCache(g_keystream_cache_mb * 1048576));
+	}
+	return cache.get();
+}
+
+static void print_keystream_stats()
+{
+	KeystreamCache *cache = keystream_cache();
+	if (!g_print_keystream_stats || !cache) {
+		return;
+	}
+	KeystreamCache::stats_t st = cache->stats();
+	fprintf(stderr, "Keystream cache: %" PRIu64 " hit(s), %" PRIu64 " miss(es), %.2f MiB cached, %.2f MiB generated\n",
+		st.hits, st.misses, st.bytes_cached / 1048576.0, st.bytes_generated / 1048576.0);
+}
 
 // verbs
 typedef int (*mabipack_verb_t)();
 
-static int do_extract()
+static int extract_open_flags()
 {
-	MabiPack pack;
-	int ret = pack.openpack(g_packfile);
-	if (ret != 0) {
-		fprintf(stderr, "ERROR: Cannot open packfile: %d\n", ret);
-		return EXIT_FAILURE;
+	int flags = g_use_mmap ? MABIPACK_OPEN_MMAP | MABIPACK_ADVISE_SEQUENTIAL : 0;
+	if (g_use_index_cache) {
+		flags |= MABIPACK_OPEN_INDEX_CACHE;
 	}
+	return flags;
+}
+
+static void setup_extract_pack(MabiPack &pack)
+{
+	pack.set_keystream_cache(keystream_cache());
+	pack.set_parallel_decrypt(std::thread::hardware_concurrency(), PARALLEL_DECRYPT_THRESHOLD);
+}
 
-	ret = chdir(g_extract_dir);
+static int enter_extract_dir()
+{
+	int ret = chdir(g_extract_dir);
 	if (ret != 0) {
 		ret = mkdir(g_extract_dir, 0755);
 		if (ret != 0) {
 			perror("mkdir");
-			return EXIT_FAILURE;
+			return -1;
 		}
 
 		ret = chdir(g_extract_dir);
 		if (ret != 0) {
 			perror("chdir");
-			return EXIT_FAILURE;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// A file to extract and the pack it comes from.
+struct extract_item
+{
+	const MabiPack *pack;
+	// Position of the pack in the set; orders the packs when planning.
+	uint32_t pack_no;
+	pack_name name;
+	const file_info *info;
+};
+
+// A run of entries that are prefetched together.
+struct readahead_window
+{
+	size_t first;
+	uint64_t offset, size;
+};
+
+// Extracts `items' (given in name order) on g_jobs workers.
+// Entries are extracted in the order they are stored in their packs rather
+// than in name order, so that every pack is read front to back. Consecutive
+// entries are grouped into windows of about EXTRACT_READAHEAD bytes; when a
+// window is started the next one is prefetched as a single range.
+// Names are printed as files are extracted, or in name order once
+// everything is done with -n.
+// In sync mode (-s) files whose output already has the right size and
+// mtime are skipped without being read, written files get the entry's
+// mtime, and with -D files matching `patterns' that are not in `items' are
+// removed afterwards from the top level directories of `items'.
+static int extract_items(const std::vector<extract_item> &items, const PatternSet &patterns)
+{
+	std::vector<size_t> order(items.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		const extract_item &x = items[a], &y = items[b];
+		return x.pack_no < y.pack_no || (x.pack_no == y.pack_no && x.info->offset < y.info->offset);
+	});
+
+	std::vector<readahead_window> windows;
+	std::vector<uint32_t> window_of(order.size());
+	for (size_t k = 0; k < order.size(); k++) {
+		const extract_item &item = items[order[k]];
+		uint64_t off = item.info->offset, end = off + item.info->size_compressed;
+		if (!windows.empty()) {
+			readahead_window &w = windows.back();
+			const extract_item &first = items[order[w.first]];
+			uint64_t w_end = w.offset + w.size;
+			if (first.pack_no == item.pack_no && end - w.offset <= EXTRACT_READAHEAD
+				&& off <= w_end + EXTRACT_READAHEAD_MAX_GAP) {
+				w.size = std::max(w_end, end) - w.offset;
+				window_of[k] = windows.size() - 1;
+				continue;
+			}
 		}
+		readahead_window w = { k, off, end - off };
+		windows.push_back(w);
+		window_of[k] = windows.size() - 1;
 	}
+	auto prefetch = [&](size_t w) {
+		if (w < windows.size()) {
+			items[order[windows[w].first]].pack->prefetch(windows[w].offset, windows[w].size);
+		}
+	};
+
+	OutputTree out;
+	if (out.open(".") < 0) {
+		perror("open");
+		return -1;
+	}
+
+	// Write errors arrive on a writeback thread, possibly after the file's
+	// name was printed; they are reported once everything is written.
+	std::mutex write_lock;
+	std::vector<std::pair<size_t, int>> write_errors;
+	std::atomic<bool> write_failed(false);
+	WriteBack writeback;
+	writeback.start(O_CREAT | O_WRONLY | O_TRUNC, 0644, WRITEBACK_MAX_INFLIGHT, std::max(g_jobs, 2),
+		[&](uint64_t token, int ret, int err) {
+			if (ret < 0) {
+				std::lock_guard<std::mutex> guard(write_lock);
+				write_errors.push_back(std::make_pair(token, err));
+				write_failed = true;
+			}
+		});
 
-	for (auto &entry : pack) {
-		if (check_patterns(g_arglist, entry.first)) {
-			printf("%s\n", entry.first.c_str());
-			int ret = extract_file(pack, entry.first, entry.second);
+	std::vector<char> extracted(items.size());
+	size_t skipped = 0;
+	bool failed = false;
+	run_ordered(order.size(), g_jobs, g_jobs * 4,
+		[&](size_t k) {
+			size_t w = window_of[k];
+			if (windows[w].first == k) {
+				if (k == 0) {
+					prefetch(w);
+				}
+				prefetch(w + 1);
+			}
+			const extract_item &item = items[order[k]];
+			int64_t mtime = -1;
+			if (g_sync) {
+				if (output_is_current(out, item.name.c_str(), *item.info)) {
+					return 1;
+				}
+				mtime = filetime_to_unix_ts(item.info->time3);
+			}
+			if (item.info->size_orig <= WRITEBACK_MAX_FILE) {
+				return extract_file_async(out, writeback, *item.pack, item.name.c_str(), *item.info, mtime, order[k]);
+			}
+			return extract_file(out, *item.pack, item.name.c_str(), *item.info, mtime);
+		},
+		[&](size_t k, int ret) {
+			if (ret == 1) {
+				skipped++;
+				return !write_failed;
+			}
+			if (!g_print_sorted) {
+				printf("%s\n", items[order[k]].name.c_str());
+			}
 			if (ret < 0) {
 				fprintf(stderr, "Error extracting the package. aborting...\n");
-				return EXIT_FAILURE;
+				failed = true;
+				return false;
+			}
+			extracted[order[k]] = 1;
+			return !write_failed;
+		});
+	writeback.finish();
+	for (const std::pair<size_t, int> &error : write_errors) {
+		fprintf(stderr, "Cannot write file %s: %s\n", items[error.first].name.c_str(), strerror(error.second));
+		extracted[error.first] = 0;
+	}
+	if (!write_errors.empty() && !failed) {
+		fprintf(stderr, "Error extracting the package. aborting...\n");
+		failed = true;
+	}
+	if (g_print_sorted) {
+		for (size_t i = 0; i < items.size(); i++) {
+			if (extracted[i]) {
+				printf("%s\n", items[i].name.c_str());
 			}
 		}
 	}
+	if (failed) {
+		return -1;
+	}
+
+	if (g_sync) {
+		long removed = 0;
+		if (g_remove_stale) {
+			// Only the top level directories of the extracted files are
+			// searched, so that nothing else kept in the output directory,
+			// such as files directly in it, is ever removed.
+			std::set<std::string> keep, top_dirs;
+			for (const extract_item &item : items) {
+				std::string path = normalize_path(item.name.c_str());
+				size_t slash = path.find('/');
+				if (slash != std::string::npos) {
+					top_dirs.insert(path.substr(0, slash));
+				}
+				keep.insert(path);
+			}
+			for (const std::string &dir : top_dirs) {
+				struct stat sb;
+				if (lstat(dir.c_str(), &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+					continue;
+				}
+				long ret = remove_stale_files(dir, keep, patterns, g_remove_dry_run);
+				if (ret < 0) {
+					return -1;
+				}
+				removed += ret;
+			}
+		}
+		fprintf(stderr, "Wrote %lu file(s), skipped %lu unchanged file(s), %s %ld stale file(s)\n",
+			(unsigned long)(items.size() - skipped), (unsigned long)skipped,
+			g_remove_dry_run ? "would remove" : "removed", removed);
+	}
+	return 0;
+}
+
+// Selection for -e and -l: the pattern arguments and the -T list.
+static int build_patterns(PatternSet &patterns)
+{
+	for (const char *pattern : g_arglist) {
+		patterns.add(pattern);
+	}
+	if (g_list_file && patterns.add_list(g_list_file) < 0) {
+		fprintf(stderr, "ERROR: Cannot read file list %s: %s\n", g_list_file, strerror(errno));
+		return -1;
+	}
+	patterns.finish();
+	return 0;
+}
+
+static int do_extract()
+{
+	MabiPack pack;
+	int ret = pack.openpack(g_packfile, extract_open_flags());
+	if (ret != 0) {
+		fprintf(stderr, "ERROR: Cannot open packfile: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	setup_extract_pack(pack);
+	std::vector<std::string> inputs;
+	add_input_files(g_packfile, inputs);
+
+	ret = enter_extract_dir();
+	if (ret != 0) {
+		return EXIT_FAILURE;
+	}
+	if (g_sync && g_remove_stale && check_stale_removal(inputs) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	PatternSet patterns;
+	if (build_patterns(patterns) < 0) {
+		return EXIT_FAILURE;
+	}
+	const MabiPack::filelist_t &files = patterns.empty() ? pack.files() : pack.folded_files();
+	std::vector<size_t> positions;
+	patterns.select(files, patterns.has_dir_prefixes() ? &pack.dir_tree() : nullptr, positions);
+	std::vector<extract_item> selected;
+	selected.reserve(positions.size());
+	for (size_t pos : positions) {
+		const auto &entry = files.at(pos);
+		extract_item item = { &pack, 0, entry.first, &entry.second };
+		selected.push_back(item);
+	}
+
+	ret = extract_items(selected, patterns);
+	if (ret < 0) {
+		return EXIT_FAILURE;
+	}
+	print_keystream_stats();
+
+	return EXIT_SUCCESS;
+}
+
+// Extracts the final version of every file in a set of packs: for paths
+// present in several packs only the copy from the highest pack version is
+// extracted, once, instead of extracting every pack over the previous one.
+// Adds the packfile argument and every further argument, packs or
+// directories of packs, to `packs'. Returns <0 on error.
+static int add_pack_sources(MabiPackSet &packs)
+{
+	std::vector<const char *> sources(1, g_packfile);
+	sources.insert(sources.end(), g_arglist.begin(), g_arglist.end());
+
+	for (const char *source : sources) {
+		struct stat sb;
+		int ret = stat(source, &sb);
+		if (ret == 0 && S_ISDIR(sb.st_mode)) {
+			ret = packs.adddir(source, extract_open_flags());
+		} else {
+			ret = packs.addpack(source, extract_open_flags());
+		}
+		if (ret != 0) {
+			fprintf(stderr, "ERROR: Cannot open packfile %s: %d\n", source, ret);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int do_extract_merged()
+{
+	MabiPackSet packs;
+	if (add_pack_sources(packs) < 0) {
+		return EXIT_FAILURE;
+	}
+	uint64_t total_entries = 0;
+	for (size_t i = 0; i < packs.pack_count(); i++) {
+		total_entries += packs.pack(i).header().filecnt;
+		setup_extract_pack(packs.pack(i));
+	}
+	int ret = packs.build();
+	if (ret != 0) {
+		fprintf(stderr, "ERROR: Cannot read package index: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	std::vector<std::string> inputs;
+	for (size_t i = 0; i < packs.pack_count(); i++) {
+		add_input_files(packs.pack_path(i).c_str(), inputs);
+	}
+
+	ret = enter_extract_dir();
+	if (ret != 0) {
+		return EXIT_FAILURE;
+	}
+	if (g_sync && g_remove_stale && check_stale_removal(inputs) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	const MabiPackSet::filelist_t &files = packs.files();
+	std::vector<extract_item> items;
+	items.reserve(files.size());
+	for (const auto &entry : files) {
+		uint32_t pack_no = MabiPackSet::pack_of(entry);
+		extract_item item = { &packs.pack(pack_no), pack_no, entry.first, &entry.second };
+		items.push_back(item);
+	}
+	ret = extract_items(items, PatternSet());
+	if (ret < 0) {
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "Extracted %lu file(s) from %lu package(s), skipped %" PRIu64 " superseded file(s)\n",
+		(unsigned long)files.size(), (unsigned long)packs.pack_count(), total_entries - files.size());
+	print_keystream_stats();
+
+	return EXIT_SUCCESS;
+}
+
+// Writes the newest version of every file in a set of packs, decoded, to
+// a store that MabiStore can read without decoding anything.
+static int do_create_store()
+{
+	MabiPackSet packs;
+	if (add_pack_sources(packs) < 0) {
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < packs.pack_count(); i++) {
+		setup_extract_pack(packs.pack(i));
+	}
+	int ret = packs.build();
+	if (ret != 0) {
+		fprintf(stderr, "ERROR: Cannot read package index: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	ret = MabiStore::create(g_store_path, packs, g_jobs, [](const pack_name &name) {
+		printf("%s\n", name.c_str());
+	});
+	if (ret < 0) {
+		fprintf(stderr, "ERROR: Cannot create store %s: %s\n", g_store_path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "Stored %lu file(s) from %lu package(s) in %s\n",
+		(unsigned long)packs.files().size(), (unsigned long)packs.pack_count(), g_store_path);
+	print_keystream_stats();
 
 	return EXIT_SUCCESS;
 }
 
 static int do_list()
 {
+	PatternSet patterns;
+	if (build_patterns(patterns) < 0) {
+		return EXIT_FAILURE;
+	}
+
 	MabiPack pack;
-	int ret = pack.openpack(g_packfile);
+	int ret = pack.openpack(g_packfile, g_use_index_cache ? MABIPACK_OPEN_INDEX_CACHE : 0);
 	if (ret != 0) {
 		fprintf(stderr, "ERROR: Cannot open packfile: %d\n", ret);
 		return EXIT_FAILURE;
@@ -187,14 +712,16 @@ static int do_list()
 	printf("Creation date: %s\n", format_filetime(hdr.time1));
 	printf("Mountpoint: %s\n", hdr.mountpoint);
 	printf("====================\n");
+	const MabiPack::filelist_t &files = patterns.empty() ? pack.files() : pack.folded_files();
+	std::vector<size_t> positions;
+	patterns.select(files, patterns.has_dir_prefixes() ? &pack.dir_tree() : nullptr, positions);
 	uint32_t cnt = 0;
 	uint64_t total_size = 0;
-	for (auto &entry : pack) {
-		if (check_patterns(g_arglist, entry.first)) {
-			printf("%.2f KiB\t%s\n", entry.second.size_orig / 1024.0f, entry.first.c_str());
-			cnt += 1;
-			total_size += entry.second.size_orig;
-		}
+	for (size_t pos : positions) {
+		const auto &entry = files.at(pos);
+		printf("%.2f KiB\t%s\n", entry.second.size_orig / 1024.0f, entry.first.c_str());
+		cnt += 1;
+		total_size += entry.second.size_orig;
 	}
 	printf("Total %d file(s), %.2f MiB\n", cnt, total_size / 1048576.0f);
 
@@ -289,12 +816,66 @@ static int do_create()
 		fprintf(stderr, "ERROR: Cannot open packfile: %d\n", ret);
 		return EXIT_FAILURE;
 	}
+	pack_writer.set_keystream_cache(keystream_cache());
+	if (g_jobs > 1) {
+		pack_writer.set_block_deflate(CREATE_STREAM_THRESHOLD,
+			g_block_deflate ? std::max<int>(g_jobs, std::thread::hardware_concurrency()) : g_jobs);
+	} else if (g_block_deflate) {
+		pack_writer.set_block_deflate(BLOCK_DEFLATE_THRESHOLD, std::thread::hardware_concurrency());
+	}
 
-	for (const std::string &path : files) {
-		fprintf(stdout, "Adding file %s\n", path.c_str());
-		ret = pack_writer.addfile(path);
-		if (ret < 0) {
-			fprintf(stderr, "ERROR: Cannot add file(%d): %s: %s\n", ret, path.c_str(), strerror(errno));
+	if (g_jobs <= 1) {
+		for (const std::string &path : files) {
+			fprintf(stdout, "Adding file %s\n", path.c_str());
+			ret = pack_writer.addfile(path);
+			if (ret < 0) {
+				fprintf(stderr, "ERROR: Cannot add file(%d): %s: %s\n", ret, path.c_str(), strerror(errno));
+				pack_writer.discard();
+				return EXIT_FAILURE;
+			}
+		}
+	} else {
+		// Workers compress and encrypt files into memory; they are appended
+		// in list order, so the pack is identical to a serial run with the
+		// same block deflate settings. The window bounds how many encoded
+		// files wait in memory.
+		std::vector<std::string> paths(files.begin(), files.end());
+		std::vector<MabiPackWriter::prepared_file> prepared(paths.size());
+		std::vector<int> job_errno(paths.size());
+		// Large files are streamed into the pack by addfile() from the main
+		// thread instead of being held in memory; block deflate spreads
+		// their compression over the threads.
+		std::vector<char> streamed(paths.size());
+		bool failed = false;
+		run_ordered(paths.size(), g_jobs, g_jobs * 2,
+			[&](size_t i) {
+				struct stat sb;
+				if (stat(paths[i].c_str(), &sb) == 0 && (uint64_t)sb.st_size >= CREATE_STREAM_THRESHOLD) {
+					streamed[i] = 1;
+					return 0;
+				}
+				int r = pack_writer.prepare_file(paths[i], prepared[i]);
+				job_errno[i] = errno;
+				return r;
+			},
+			[&](size_t i, int r) {
+				fprintf(stdout, "Adding file %s\n", paths[i].c_str());
+				if (r >= 0 && streamed[i]) {
+					r = pack_writer.addfile(paths[i]);
+					job_errno[i] = errno;
+				} else if (r >= 0) {
+					r = pack_writer.append_prepared(prepared[i]);
+					job_errno[i] = errno;
+				}
+				std::vector<char>().swap(prepared[i].data);
+				if (r < 0) {
+					fprintf(stderr, "ERROR: Cannot add file(%d): %s: %s\n", r, paths[i].c_str(), strerror(job_errno[i]));
+					failed = true;
+					return false;
+				}
+				return true;
+			});
+		if (failed) {
 			pack_writer.discard();
 			return EXIT_FAILURE;
 		}
@@ -306,6 +887,7 @@ static int do_create()
 		pack_writer.discard();
 		return EXIT_FAILURE;
 	}
+	print_keystream_stats();
 
 	return EXIT_SUCCESS;
 }
@@ -313,14 +895,28 @@ static int do_create()
 static int do_usage()
 {
 	fprintf(stderr, "Usage: %s <options> <packfile> [patterns...]\n", g_program_name);
+	fprintf(stderr, "       %s -M <options> <packfile|directory>...\n", g_program_name);
+	fprintf(stderr, "       %s -S <store> <options> <packfile|directory>...\n", g_program_name);
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "\t-h - help message\n");
 	fprintf(stderr, "\t-l - list files in the package\n");
 	fprintf(stderr, "\t-e - extract files in the package (default)\n");
 	fprintf(stderr, "\t-c - create a new package\n");
+	fprintf(stderr, "\t-M - extract the newest version of every file in several packages\n");
+	fprintf(stderr, "\t-S - write the newest version of every file in several packages, decoded, to a store\n");
 	fprintf(stderr, "\t-d - set output directory (extract only)\n");
+	fprintf(stderr, "\t-n - print extracted file names in name order when done (extract only)\n");
+	fprintf(stderr, "\t-s - sync: skip files whose size and mtime are unchanged, set mtimes (extract only)\n");
+	fprintf(stderr, "\t-D - with -s, remove files that are not in the package from its top level directories (extract only)\n");
+	fprintf(stderr, "\t-R - with -D, only list the files that would be removed (extract only)\n");
+	fprintf(stderr, "\t-T - also select the paths listed in a file, one per line (extract and list)\n");
+	fprintf(stderr, "\t-j - number of worker threads (extract and create); when creating, files over 8 MiB are compressed in blocks on them\n");
+	fprintf(stderr, "\t-N - read the package with read(2) instead of mmap(2)\n");
+	fprintf(stderr, "\t-I - use and maintain a file index cache next to the package (<packfile>.idx)\n");
 	fprintf(stderr, "\t-v - set package version (create only)\n");
 	fprintf(stderr, "\t-m - set package mountpoint (create only)\n");
+	fprintf(stderr, "\t-P - compress files over 64 MiB in blocks on all cores (create only)\n");
+	fprintf(stderr, "\t-K - set keystream cache size in MiB, 0 disables it (default 32); prints cache statistics\n");
 
 	return EXIT_SUCCESS;
 }
@@ -332,7 +928,7 @@ int main(int argc, char *argv[])
 	g_program_name = argv[0];
 	mabipack_verb_t func = do_extract;
 	int opt;
-	while ((opt = getopt(argc, argv, "hlecd:v:m:")) != -1) {
+	while ((opt = getopt(argc, argv, "hlecMS:d:nsDRT:j:NIv:m:PK:")) != -1) {
 		switch (opt) {
 		case 'h':
 			do_usage();
@@ -350,10 +946,54 @@ int main(int argc, char *argv[])
 			func = do_create;
 			break;
 
+		case 'M':
+			func = do_extract_merged;
+			break;
+
+		case 'S':
+			func = do_create_store;
+			g_store_path = optarg;
+			break;
+
 		case 'd':
 			g_extract_dir = optarg;
 			break;
 
+		case 'n':
+			g_print_sorted = true;
+			break;
+
+		case 's':
+			g_sync = true;
+			break;
+
+		case 'D':
+			g_remove_stale = true;
+			break;
+
+		case 'R':
+			g_remove_dry_run = true;
+			break;
+
+		case 'T':
+			g_list_file = optarg;
+			break;
+
+		case 'j':
+			g_jobs = atoi(optarg);
+			if (g_jobs < 1) {
+				g_jobs = 1;
+			}
+			break;
+
+		case 'N':
+			g_use_mmap = false;
+			break;
+
+		case 'I':
+			g_use_index_cache = true;
+			break;
+
 		case 'v':
 			g_pack_version = atoi(optarg);
 			break;
@@ -361,6 +1001,24 @@ int main(int argc, char *argv[])
 		case 'm':
 			g_pack_mountpoint = optarg;
 			break;
+
+		case 'P':
+			g_block_deflate = true;
+			break;
+
+		case 'K': {
+			char *end;
+			errno = 0;
+			long mb = strtol(optarg, &end, 10);
+			if (end == optarg || *end || errno || mb < 0 || (unsigned long)mb > SIZE_MAX / 1048576) {
+				fprintf(stderr, "Error: Invalid keystream cache size: %s\n", optarg);
+				do_usage();
+				exit(EXIT_FAILURE);
+			}
+			g_keystream_cache_mb = mb;
+			g_print_keystream_stats = true;
+			break;
+		}
 		}
 	}
 	if (optind >= argc) {
@@ -0,0 +1,234 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+
+#include <vector>
+#include <mutex>
+
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "outputtree.h"
+
+
+// dir_locked() result for directories that are not kept open: use the
+// root fd and the path relative to the root instead.
+static const int ROOT_RELATIVE = -4;
+
+static bool is_dotdot(const char *name, size_t len)
+{
+	return len == 2 && name[0] == '.' && name[1] == '.';
+}
+
+
+OutputTree::OutputTree(size_t max_dir_fds)
+	: max_dir_fds_(max_dir_fds)
+	, root_fd_(-1)
+	, open_fds_(0)
+{
+}
+
+OutputTree::~OutputTree()
+{
+	close();
+}
+
+int OutputTree::open(const char *root)
+{
+	close();
+	root_fd_ = ::open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (root_fd_ < 0) {
+		return -1;
+	}
+	hash_.assign(64, 0);
+	return 0;
+}
+
+void OutputTree::close()
+{
+	for (const dir_entry &dir : dirs_) {
+		if (dir.fd >= 0) {
+			::close(dir.fd);
+		}
+	}
+	dirs_.clear();
+	names_.clear();
+	hash_.clear();
+	open_fds_ = 0;
+	if (root_fd_ >= 0) {
+		::close(root_fd_);
+		root_fd_ = -1;
+	}
+}
+
+int OutputTree::create(const char *path, int flags, mode_t mode)
+{
+	const char *name;
+	int dirfd = parent_of(path, &name);
+	if (dirfd < 0) {
+		return dirfd;
+	}
+	int fd = ::openat(dirfd, name, flags | O_CLOEXEC, mode);
+	if (fd < 0) {
+		return -1;
+	}
+	return fd;
+}
+
+int OutputTree::unlink(const char *path)
+{
+	const char *name;
+	int dirfd = parent_of(path, &name);
+	if (dirfd < 0) {
+		return dirfd;
+	}
+	return ::unlinkat(dirfd, name, 0);
+}
+
+int OutputTree::parent_of(const char *path, const char **name)
+{
+	while (*path == '/') {
+		path++;
+	}
+	const char *slash = strrchr(path, '/');
+	const char *base = slash ? slash + 1 : path;
+	if (is_dotdot(base, strlen(base))) {
+		return -2;
+	}
+	*name = base;
+	if (!slash) {
+		return root_fd_;
+	}
+
+	int dirfd;
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		dirfd = dir_locked(path, slash - path);
+	}
+	if (dirfd == ROOT_RELATIVE) {
+		*name = path;
+		return root_fd_;
+	}
+	return dirfd;
+}
+
+// Returns the fd of directory `path' (not null terminated), creating it and
+// its ancestors if needed. Returns ROOT_RELATIVE if it exists but is not
+// kept open, -2 if the path has a ".." component, -3 if mkdir failed or
+// -1 on other errors.
+int OutputTree::dir_locked(const char *path, size_t len)
+{
+	if (len == 0) {
+		return root_fd_;
+	}
+	int idx = find_locked(path, len);
+	if (idx >= 0) {
+		return dirs_[idx].fd >= 0 ? dirs_[idx].fd : ROOT_RELATIVE;
+	}
+
+	const char *slash = (const char *)memrchr(path, '/', len);
+	size_t parent_len = slash ? slash - path : 0;
+	const char *comp = slash ? slash + 1 : path;
+	size_t comp_len = len - (comp - path);
+	if (comp_len == 0 || (comp_len == 1 && comp[0] == '.')) {
+		// "a//b" and "a/./b" are "a/b".
+		return dir_locked(path, parent_len);
+	}
+	if (is_dotdot(comp, comp_len)) {
+		return -2;
+	}
+	int parent = dir_locked(path, parent_len);
+	if (parent < 0 && parent != ROOT_RELATIVE) {
+		return parent;
+	}
+
+	// mkdirat() needs a null terminated name: either the last component
+	// relative to the parent, or the whole path relative to the root.
+	int at = parent;
+	const char *src = comp;
+	size_t src_len = comp_len;
+	if (parent == ROOT_RELATIVE) {
+		at = root_fd_;
+		src = path;
+		src_len = len;
+	}
+	char buf[PATH_MAX];
+	if (src_len >= sizeof (buf)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	std::memcpy(buf, src, src_len);
+	buf[src_len] = '\0';
+
+	int ret = ::mkdirat(at, buf, 0755);
+	if (ret != 0 && errno != EEXIST) {
+		return -3;
+	}
+	int fd = -1;
+	if (open_fds_ < max_dir_fds_) {
+		fd = ::openat(at, buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			return -1;
+		}
+		open_fds_++;
+	}
+	insert_locked(path, len, fd);
+	return fd >= 0 ? fd : ROOT_RELATIVE;
+}
+
+int OutputTree::find_locked(const char *path, size_t len) const
+{
+	size_t mask = hash_.size() - 1;
+	size_t slot = hash_path(path, len) & mask;
+	while (hash_[slot] != 0) {
+		const dir_entry &dir = dirs_[hash_[slot] - 1];
+		if (dir.name_len == len && !std::memcmp(&names_[dir.name_off], path, len)) {
+			return hash_[slot] - 1;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return -1;
+}
+
+void OutputTree::insert_locked(const char *path, size_t len, int fd)
+{
+	dir_entry dir;
+	dir.name_off = names_.size();
+	dir.name_len = len;
+	dir.fd = fd;
+	names_.insert(names_.end(), path, path + len);
+	dirs_.push_back(dir);
+
+	auto place = [this](size_t i) {
+		size_t mask = hash_.size() - 1;
+		size_t slot = hash_path(&names_[dirs_[i].name_off], dirs_[i].name_len) & mask;
+		while (hash_[slot] != 0) {
+			slot = (slot + 1) & mask;
+		}
+		hash_[slot] = i + 1;
+	};
+	if (dirs_.size() * 2 > hash_.size()) {
+		std::vector<uint32_t>(hash_.size() * 2, 0).swap(hash_);
+		for (size_t i = 0; i < dirs_.size(); i++) {
+			place(i);
+		}
+	} else {
+		place(dirs_.size() - 1);
+	}
+}
+
+// FNV-1a
+uint32_t OutputTree::hash_path(const char *path, size_t len)
+{
+	uint32_t h = 2166136261U;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)path[i];
+		h *= 16777619U;
+	}
+	return h;
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+#pragma once
+
+// Where extracted files are written.
+// Directories are created once and remembered together with an open fd, so
+// a file is created with openat() relative to its parent instead of walking
+// and mkdir()ing every ancestor again. Paths are '/' separated and relative
+// to the root; a ".." component is rejected. Safe to use from several
+// threads at once.
+class OutputTree
+{
+public:
+	// At most `max_dir_fds' directory fds are kept open. Directories beyond
+	// that are still remembered, but files in them are opened relative to
+	// the root.
+	explicit OutputTree(size_t max_dir_fds=256);
+	~OutputTree();
+
+	// Returns <0 on error and errno is set appropriately.
+	int open(const char *root);
+	void close();
+
+	// Opens `path', creating its parent directories as needed.
+	// Returns the fd, or <0 on error; -2 if the path is not acceptable and -3
+	// if a directory could not be created.
+	int create(const char *path, int flags, mode_t mode);
+	// Returns <0 on error.
+	int unlink(const char *path);
+	// Creates the parent directories of `path' and returns the directory fd
+	// that `*name' is relative to. The fd stays valid until close().
+	// Returns <0 on error like create().
+	int parent_of(const char *path, const char **name);
+
+private:
+	struct dir_entry
+	{
+		uint32_t name_off;
+		uint32_t name_len;
+		// -1 if not kept open.
+		int fd;
+	};
+
+	int dir_locked(const char *path, size_t len);
+	int find_locked(const char *path, size_t len) const;
+	void insert_locked(const char *path, size_t len, int fd);
+	static uint32_t hash_path(const char *path, size_t len);
+
+private:
+	size_t max_dir_fds_;
+	int root_fd_;
+	std::mutex lock_;
+	size_t open_fds_;
+	std::vector<char> names_;
+	std::vector<dir_entry> dirs_;
+	// entry number + 1; 0 means empty. Size is a power of 2.
+	std::vector<uint32_t> hash_;
+};
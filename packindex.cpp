@@ -0,0 +1,364 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <zlib.h>
+
+#include "mabipack.h"
+#include "packindex.h"
+#include "fileutil.h"
+
+
+// Layout of a saved index file. Sections follow the header in the order
+// names, entries, hash table, each aligned to 8 bytes.
+struct pack_index_file_header
+{
+	char magic[8];
+	// sizeof(PackIndex::entry), to catch layout changes.
+	uint32_t entry_size;
+	uint32_t count;
+	uint64_t nslots;
+	uint64_t names_off, names_size;
+	uint64_t entries_off;
+	uint64_t hash_off;
+	uint64_t file_size;
+	pack_index_key key;
+	// adler32 of everything after the header.
+	uint32_t body_checksum;
+	uint32_t padding;
+};
+
+static const char PACK_INDEX_MAGIC[8] = {'M', 'A', 'B', 'I', 'I', 'D', 'X', '1'};
+
+static uint64_t align8(uint64_t off)
+{
+	return (off + 7) & ~(uint64_t)7;
+}
+
+
+PackIndex::PackIndex()
+	: names_(nullptr)
+	, names_size_(0)
+	, entries_(nullptr)
+	, count_(0)
+	, hash_(nullptr)
+	, nslots_(0)
+	, folded_(false)
+	, map_(nullptr)
+	, map_size_(0)
+{
+}
+
+PackIndex::~PackIndex()
+{
+	clear();
+}
+
+void PackIndex::clear()
+{
+	std::vector<char>().swap(names_buf_);
+	std::vector<entry>().swap(entries_buf_);
+	std::vector<uint32_t>().swap(hash_buf_);
+	folded_ = false;
+	std::vector<char>().swap(lower_names_);
+	std::vector<uint32_t>().swap(lower_order_);
+	if (map_) {
+		::munmap(map_, map_size_);
+		map_ = nullptr;
+		map_size_ = 0;
+	}
+	names_ = nullptr;
+	names_size_ = 0;
+	entries_ = nullptr;
+	count_ = 0;
+	hash_ = nullptr;
+	nslots_ = 0;
+}
+
+void PackIndex::reserve(size_t count, size_t name_bytes)
+{
+	entries_buf_.reserve(count);
+	names_buf_.reserve(name_bytes);
+}
+
+void PackIndex::add(const char *name, size_t len, const file_info &info, uint32_t tag)
+{
+	entry ent;
+	std::memset(&ent, 0, sizeof (ent));
+	ent.name_off = names_buf_.size();
+	ent.name_len = len;
+	ent.info = info;
+	ent.tag = tag;
+	names_buf_.insert(names_buf_.end(), name, name + len);
+	names_buf_.push_back('\0');
+	entries_buf_.push_back(ent);
+}
+
+void PackIndex::finish()
+{
+	const char *names = names_buf_.data();
+	std::stable_sort(entries_buf_.begin(), entries_buf_.end(), [names](const entry &a, const entry &b) {
+		int cmp = std::memcmp(names + a.name_off, names + b.name_off, std::min(a.name_len, b.name_len));
+		return cmp < 0 || (cmp == 0 && a.name_len < b.name_len);
+	});
+	// Keep the first of duplicate names, like std::map::insert does.
+	size_t added = entries_buf_.size();
+	entries_buf_.erase(std::unique(entries_buf_.begin(), entries_buf_.end(), [names](const entry &a, const entry &b) {
+		return a.name_len == b.name_len && !std::memcmp(names + a.name_off, names + b.name_off, a.name_len);
+	}), entries_buf_.end());
+	if (entries_buf_.size() != added) {
+		// Drop the names of the removed duplicates from the arena.
+		std::vector<char> compact;
+		size_t name_bytes = 0;
+		for (const entry &ent : entries_buf_) {
+			name_bytes += ent.name_len + 1;
+		}
+		compact.reserve(name_bytes);
+		for (entry &ent : entries_buf_) {
+			const char *name = names + ent.name_off;
+			ent.name_off = compact.size();
+			compact.insert(compact.end(), name, name + ent.name_len + 1);
+		}
+		names_buf_.swap(compact);
+	}
+	names_buf_.shrink_to_fit();
+	entries_buf_.shrink_to_fit();
+	names = names_buf_.data();
+
+	size_t nslots = 16;
+	while (nslots < entries_buf_.size() * 2) {
+		nslots *= 2;
+	}
+	std::vector<uint32_t>(nslots, 0).swap(hash_buf_);
+	for (size_t i = 0; i < entries_buf_.size(); i++) {
+		const entry &ent = entries_buf_[i];
+		size_t slot = hash_name(names + ent.name_off, ent.name_len) & (nslots - 1);
+		while (hash_buf_[slot] != 0) {
+			slot = (slot + 1) & (nslots - 1);
+		}
+		hash_buf_[slot] = i + 1;
+	}
+
+	names_ = names;
+	names_size_ = names_buf_.size();
+	entries_ = entries_buf_.data();
+	count_ = entries_buf_.size();
+	hash_ = hash_buf_.data();
+	nslots_ = nslots;
+}
+
+int PackIndex::save(const std::string &path, const pack_index_key &key) const
+{
+	pack_index_file_header hdr;
+	std::memset(&hdr, 0, sizeof (hdr));
+	std::memcpy(hdr.magic, PACK_INDEX_MAGIC, sizeof (hdr.magic));
+	hdr.entry_size = sizeof (entry);
+	hdr.count = count_;
+	hdr.nslots = nslots_;
+	hdr.names_off = sizeof (hdr);
+	hdr.names_size = names_size_;
+	hdr.entries_off = align8(hdr.names_off + hdr.names_size);
+	hdr.hash_off = align8(hdr.entries_off + count_ * sizeof (entry));
+	hdr.file_size = hdr.hash_off + nslots_ * sizeof (uint32_t);
+	hdr.key = key;
+
+	static const char zeros[8] = {0};
+	size_t names_pad = hdr.entries_off - (hdr.names_off + hdr.names_size);
+	size_t entries_pad = hdr.hash_off - (hdr.entries_off + count_ * sizeof (entry));
+	uLong sum = adler32(0, nullptr, 0);
+	sum = adler32(sum, (const Bytef *)names_, names_size_);
+	sum = adler32(sum, (const Bytef *)zeros, names_pad);
+	sum = adler32(sum, (const Bytef *)entries_, count_ * sizeof (entry));
+	sum = adler32(sum, (const Bytef *)zeros, entries_pad);
+	sum = adler32(sum, (const Bytef *)hash_, nslots_ * sizeof (uint32_t));
+	hdr.body_checksum = sum;
+
+	ReplaceFile file;
+	if (file.open(path) < 0) {
+		return -1;
+	}
+	int fd = file.fd();
+	if (write_full(fd, &hdr, sizeof (hdr)) < 0
+		|| write_full(fd, names_, names_size_) < 0
+		|| write_full(fd, zeros, names_pad) < 0
+		|| write_full(fd, entries_, count_ * sizeof (entry)) < 0
+		|| write_full(fd, zeros, entries_pad) < 0
+		|| write_full(fd, hash_, nslots_ * sizeof (uint32_t)) < 0) {
+		return -2;
+	}
+	if (file.commit() < 0) {
+		return -3;
+	}
+	return 0;
+}
+
+int PackIndex::load(const std::string &path, const pack_index_key &key)
+{
+	clear();
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	struct stat sb;
+	if (::fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof (pack_index_file_header)) {
+		::close(fd);
+		return -2;
+	}
+	void *map = ::mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) {
+		return -3;
+	}
+
+	const char *base = (const char *)map;
+	pack_index_file_header hdr;
+	std::memcpy(&hdr, base, sizeof (hdr));
+	uint64_t size = sb.st_size;
+	bool valid = !std::memcmp(hdr.magic, PACK_INDEX_MAGIC, sizeof (hdr.magic))
+		&& hdr.entry_size == sizeof (entry)
+		&& hdr.file_size == size
+		&& hdr.key.pack_size == key.pack_size
+		&& hdr.key.pack_mtime_sec == key.pack_mtime_sec
+		&& hdr.key.pack_mtime_nsec == key.pack_mtime_nsec
+		&& hdr.key.pack_version == key.pack_version
+		&& hdr.key.filecnt == key.filecnt
+		&& hdr.nslots >= 16 && (hdr.nslots & (hdr.nslots - 1)) == 0 && hdr.nslots > hdr.count
+		&& hdr.names_off == sizeof (hdr)
+		&& (hdr.names_size > 0 || hdr.count == 0) && hdr.names_size <= size
+		&& hdr.entries_off == align8(hdr.names_off + hdr.names_size)
+		&& hdr.hash_off == align8(hdr.entries_off + (uint64_t)hdr.count * sizeof (entry))
+		&& hdr.hash_off + hdr.nslots * sizeof (uint32_t) == size;
+	if (valid) {
+		uLong sum = adler32(0, nullptr, 0);
+		sum = adler32(sum, (const Bytef *)base + sizeof (hdr), size - sizeof (hdr));
+		valid = sum == hdr.body_checksum;
+	}
+	// Every name must lie in the arena and be null terminated, as the
+	// checksum only catches accidental damage.
+	const char *names = base + hdr.names_off;
+	const entry *entries = (const entry *)(base + hdr.entries_off);
+	for (uint32_t i = 0; valid && i < hdr.count; i++) {
+		const entry &ent = entries[i];
+		valid = (uint64_t)ent.name_off + ent.name_len < hdr.names_size && names[ent.name_off + ent.name_len] == '\0';
+	}
+	// find_entry() probes until it reaches an empty slot, so there must be
+	// one, and every other slot must name an entry.
+	const uint32_t *hash = (const uint32_t *)(base + hdr.hash_off);
+	bool has_empty = false;
+	for (uint64_t i = 0; valid && i < hdr.nslots; i++) {
+		valid = hash[i] <= hdr.count;
+		has_empty = has_empty || hash[i] == 0;
+	}
+	valid = valid && has_empty;
+	if (!valid) {
+		::munmap(map, sb.st_size);
+		return -4;
+	}
+
+	map_ = map;
+	map_size_ = sb.st_size;
+	names_ = names;
+	names_size_ = hdr.names_size;
+	entries_ = entries;
+	count_ = hdr.count;
+	hash_ = hash;
+	nslots_ = hdr.nslots;
+	return 0;
+}
+
+const PackIndex::entry *PackIndex::find_entry(const char *name, size_t len) const
+{
+	if (nslots_ == 0) {
+		return nullptr;
+	}
+	size_t mask = nslots_ - 1;
+	size_t slot = hash_name(name, len) & mask;
+	while (hash_[slot] != 0) {
+		const entry &ent = entries_[hash_[slot] - 1];
+		if (ent.name_len == len && !std::memcmp(names_ + ent.name_off, name, len)) {
+			return &ent;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return nullptr;
+}
+
+void PackIndex::fold()
+{
+	lower_names_.resize(names_size_);
+	for (size_t i = 0; i < names_size_; i++) {
+		lower_names_[i] = fold_char(names_[i]);
+	}
+	lower_order_.resize(count_);
+	for (size_t i = 0; i < count_; i++) {
+		lower_order_[i] = i;
+	}
+	const char *lower = lower_names_.data();
+	const entry *entries = entries_;
+	std::sort(lower_order_.begin(), lower_order_.end(), [lower, entries](uint32_t a, uint32_t b) {
+		const entry &x = entries[a], &y = entries[b];
+		int cmp = std::memcmp(lower + x.name_off, lower + y.name_off, std::min(x.name_len, y.name_len));
+		return cmp < 0 || (cmp == 0 && (x.name_len < y.name_len || (x.name_len == y.name_len && a < b)));
+	});
+	folded_ = true;
+}
+
+std::pair<size_t, size_t> PackIndex::folded_range(const char *key, size_t len, bool exact) const
+{
+	const char *lower = lower_names_.data();
+	const entry *entries = entries_;
+	// <0, 0 or >0 as the name is before, in or after the range.
+	auto compare = [=](uint32_t pos) {
+		const entry &ent = entries[pos];
+		int cmp = std::memcmp(lower + ent.name_off, key, std::min((size_t)ent.name_len, len));
+		if (cmp != 0) {
+			return cmp;
+		}
+		if (ent.name_len < len) {
+			return -1;
+		}
+		return (exact && ent.name_len > len) ? 1 : 0;
+	};
+	auto first = std::partition_point(lower_order_.begin(), lower_order_.end(), [&](uint32_t pos) {
+		return compare(pos) < 0;
+	});
+	auto last = std::partition_point(first, lower_order_.end(), [&](uint32_t pos) {
+		return compare(pos) == 0;
+	});
+	return std::make_pair(first - lower_order_.begin(), last - lower_order_.begin());
+}
+
+size_t PackIndex::memory_usage() const
+{
+	return names_buf_.capacity() + entries_buf_.capacity() * sizeof (entry) + hash_buf_.capacity() * sizeof (uint32_t)
+		+ lower_names_.capacity() + lower_order_.capacity() * sizeof (uint32_t);
+}
+
+// FNV-1a
+uint32_t PackIndex::hash_name(const char *name, size_t len)
+{
+	uint32_t h = 2166136261U;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619U;
+	}
+	return h;
+}
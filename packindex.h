@@ -0,0 +1,160 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+#pragma once
+
+// A name stored in a PackIndex. Always null terminated.
+class pack_name
+{
+public:
+	pack_name(const char *name, uint32_t len)
+		: name_(name), len_(len)
+	{
+	}
+
+	const char *c_str() const { return name_; }
+	const char *data() const { return name_; }
+	size_t size() const { return len_; }
+	bool empty() const { return len_ == 0; }
+	std::string str() const { return std::string(name_, len_); }
+
+private:
+	const char *name_;
+	uint32_t len_;
+};
+
+// Identifies the pack a saved index was built from.
+struct pack_index_key
+{
+	uint64_t pack_size;
+	int64_t pack_mtime_sec;
+	int64_t pack_mtime_nsec;
+	uint32_t pack_version;
+	uint32_t filecnt;
+};
+
+// Flat, sorted file index of a pack.
+// Names live in one arena and entries in one array sorted by name, so that
+// iteration is in the same order as a std::map<std::string, file_info>.
+// Exact lookups go through an open addressing hash table of entry numbers.
+// Everything is offset based, so a finished index can be saved to a file
+// and later used straight from a read-only mapping of it.
+class PackIndex
+{
+public:
+	struct entry
+	{
+		// Offset of the name in the name arena.
+		uint32_t name_off;
+		uint32_t name_len;
+		file_info info;
+		// Caller defined. MabiPackSet stores the pack number here.
+		uint32_t tag;
+	};
+
+	// What iteration yields; mirrors std::map's value_type.
+	struct value_type
+	{
+		pack_name first;
+		const file_info &second;
+		uint32_t tag;
+	};
+
+	class const_iterator
+	{
+	public:
+		const_iterator(const PackIndex *index, size_t pos)
+			: index_(index), pos_(pos)
+		{
+		}
+
+		value_type operator*() const { return index_->at(pos_); }
+		const_iterator &operator++() { pos_++; return *this; }
+		bool operator==(const const_iterator &other) const { return pos_ == other.pos_; }
+		bool operator!=(const const_iterator &other) const { return pos_ != other.pos_; }
+
+	private:
+		const PackIndex *index_;
+		size_t pos_;
+	};
+	typedef const_iterator iterator;
+
+public:
+	PackIndex();
+	~PackIndex();
+
+	void clear();
+
+	// Building: add() entries in any order, then call finish() once.
+	void reserve(size_t count, size_t name_bytes);
+	void add(const char *name, size_t len, const file_info &info, uint32_t tag=0);
+	// Sorts the entries and builds the hash table. If a name was added more
+	// than once the first one is kept.
+	void finish();
+
+	// Writes a finished index to `path'. The file is replaced atomically.
+	// Returns <0 on error and errno is set appropriately.
+	int save(const std::string &path, const pack_index_key &key) const;
+	// Maps an index written by save(). Fails if the file is corrupt or was
+	// built from a different pack. Returns <0 on error.
+	int load(const std::string &path, const pack_index_key &key);
+
+	const entry *find_entry(const char *name, size_t len) const;
+	const file_info *find(const char *name, size_t len) const
+	{
+		const entry *ent = find_entry(name, len);
+		return ent ? &ent->info : nullptr;
+	}
+	const file_info *find(const std::string &name) const { return find(name.data(), name.size()); }
+
+	size_t size() const { return count_; }
+	bool empty() const { return count_ == 0; }
+	value_type at(size_t pos) const
+	{
+		const entry &ent = entries_[pos];
+		value_type v = { pack_name(names_ + ent.name_off, ent.name_len), ent.info, ent.tag };
+		return v;
+	}
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, count_); }
+
+	// Case-folded view for pattern matching. fold() lowercases every name
+	// into a second arena with the same offsets, and sorts the entry numbers
+	// by lowercase name. It is not saved with the index.
+	void fold();
+	// How fold() lowercases a byte: like tolower() in the C locale, which
+	// wc_match_nocase() relies on.
+	static char fold_char(char c) { return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c; }
+	bool is_folded() const { return folded_; }
+	// Lowercase name of entry `pos'. Requires fold().
+	const char *lower_name(size_t pos) const { return lower_names_.data() + entries_[pos].name_off; }
+	// Entry numbers in lowercase name order. Requires fold().
+	const std::vector<uint32_t> &folded_order() const { return lower_order_; }
+	// The range of folded_order() whose lowercase names start with, or with
+	// `exact' are equal to, the lowercase string `key'. Requires fold().
+	std::pair<size_t, size_t> folded_range(const char *key, size_t len, bool exact) const;
+
+	// Bytes of heap memory held by the index.
+	size_t memory_usage() const;
+
+private:
+	static uint32_t hash_name(const char *name, size_t len);
+
+private:
+	// Either point into the buffers below or into map_.
+	const char *names_;
+	size_t names_size_;
+	const entry *entries_;
+	size_t count_;
+	// entry number + 1; 0 means empty. Size is a power of 2.
+	const uint32_t *hash_;
+	size_t nslots_;
+
+	std::vector<char> names_buf_;
+	std::vector<entry> entries_buf_;
+	std::vector<uint32_t> hash_buf_;
+	bool folded_;
+	std::vector<char> lower_names_;
+	std::vector<uint32_t> lower_order_;
+	void *map_;
+	size_t map_size_;
+};
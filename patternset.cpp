@@ -0,0 +1,289 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <errno.h>
+
+#include "mabipack.h"
+#include "patternset.h"
+
+
+static std::string fold(const char *str, size_t len)
+{
+	std::string lower(str, len);
+	for (char &c : lower) {
+		c = PackIndex::fold_char(c);
+	}
+	return lower;
+}
+
+// Whether the "prefix*" pattern `prefix' is "dir/*" for a directory that a
+// DirTree can look up: it ends with '/' and every component before that is
+// non-empty. "/*" or "a//*" are left to plain prefix matching, which is
+// what wc_match_nocase() does with them.
+static bool is_dir_prefix(const std::string &prefix)
+{
+	return prefix.size() > 1 && prefix.back() == '/' && prefix[0] != '/'
+		&& prefix.find("//") == std::string::npos;
+}
+
+// Adds bit i + 1 for every set bit i that is a '*' position: a '*' may
+// match nothing. Runs of '*' are collapsed when compiling, so one pass is
+// enough.
+static inline void close_stars(uint64_t *bits, const uint64_t *star, size_t words)
+{
+	uint64_t carry = 0;
+	for (size_t w = 0; w < words; w++) {
+		uint64_t s = bits[w] & star[w];
+		bits[w] |= (s << 1) | carry;
+		carry = s >> 63;
+	}
+}
+
+
+PatternSet::PatternSet()
+	: match_all_(false)
+	, has_dir_prefixes_(false)
+	, has_list_(false)
+	, words_(0)
+{
+}
+
+void PatternSet::add(const char *pattern)
+{
+	std::string lower;
+	for (const char *p = pattern; *p; p++) {
+		if (*p == '*' && !lower.empty() && lower.back() == '*') {
+			continue;
+		}
+		lower += PackIndex::fold_char(*p);
+	}
+
+	size_t wild = lower.find_first_of("*?");
+	if (wild == std::string::npos) {
+		exact_.push_back(lower);
+	} else if (wild == lower.size() - 1 && lower[wild] == '*') {
+		if (wild == 0) {
+			match_all_ = true;
+		} else {
+			lower.resize(wild);
+			prefixes_.push_back(lower);
+			has_dir_prefixes_ = has_dir_prefixes_ || is_dir_prefix(lower);
+		}
+	} else {
+		globs_.push_back(lower);
+	}
+}
+
+void PatternSet::add_exact(const char *name, size_t len)
+{
+	exact_.push_back(fold(name, len));
+}
+
+int PatternSet::add_list(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		return -1;
+	}
+	has_list_ = true;
+	char *line = nullptr;
+	size_t size = 0;
+	ssize_t len;
+	while ((len = getline(&line, &size, fp)) >= 0) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+			len--;
+		}
+		if (len > 0) {
+			add_exact(line, len);
+		}
+	}
+	bool failed = ferror(fp);
+	free(line);
+	fclose(fp);
+	if (failed) {
+		errno = EIO;
+		return -2;
+	}
+	return 0;
+}
+
+void PatternSet::finish()
+{
+	std::sort(exact_.begin(), exact_.end());
+	exact_.erase(std::unique(exact_.begin(), exact_.end()), exact_.end());
+
+	glob_prefixes_.clear();
+	size_t bits = 0;
+	for (const std::string &glob : globs_) {
+		bits += glob.size() + 1;
+		std::string prefix = glob.substr(0, glob.find_first_of("*?"));
+		if (prefix.empty()) {
+			glob_prefixes_.clear();
+			bits = 0;
+			break;
+		}
+		glob_prefixes_.push_back(prefix);
+	}
+	if (bits == 0) {
+		for (const std::string &glob : globs_) {
+			bits += glob.size() + 1;
+		}
+	}
+	std::sort(glob_prefixes_.begin(), glob_prefixes_.end());
+	glob_prefixes_.erase(std::unique(glob_prefixes_.begin(), glob_prefixes_.end()), glob_prefixes_.end());
+
+	words_ = (bits + 63) / 64;
+	char_mask_.assign(256 * words_, 0);
+	star_mask_.assign(words_, 0);
+	start_.assign(words_, 0);
+	accept_.assign(words_, 0);
+	auto set = [](std::vector<uint64_t> &v, size_t base, size_t bit) {
+		v[base + bit / 64] |= (uint64_t)1 << (bit % 64);
+	};
+	size_t pos = 0;
+	for (const std::string &glob : globs_) {
+		set(start_, 0, pos);
+		for (size_t i = 0; i < glob.size(); i++, pos++) {
+			char c = glob[i];
+			if (c == '*') {
+				set(star_mask_, 0, pos);
+			} else if (c == '?') {
+				for (int b = 0; b < 256; b++) {
+					set(char_mask_, b * words_, pos);
+				}
+			} else {
+				set(char_mask_, (uint8_t)c * words_, pos);
+			}
+		}
+		set(accept_, 0, pos);
+		pos++;
+	}
+	if (words_ > 0) {
+		close_stars(start_.data(), star_mask_.data(), words_);
+	}
+}
+
+bool PatternSet::match_globs(const char *lower, size_t len, uint64_t *cur, uint64_t *next) const
+{
+	std::copy(start_.begin(), start_.end(), cur);
+	for (size_t i = 0; i < len; i++) {
+		const uint64_t *mask = &char_mask_[(uint8_t)lower[i] * words_];
+		uint64_t carry = 0, any = 0;
+		for (size_t w = 0; w < words_; w++) {
+			uint64_t x = cur[w] & mask[w];
+			next[w] = (x << 1) | carry | (cur[w] & star_mask_[w]);
+			carry = x >> 63;
+		}
+		close_stars(next, star_mask_.data(), words_);
+		for (size_t w = 0; w < words_; w++) {
+			any |= next[w];
+		}
+		if (!any) {
+			return false;
+		}
+		std::swap(cur, next);
+	}
+	for (size_t w = 0; w < words_; w++) {
+		if (cur[w] & accept_[w]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool PatternSet::match(const char *name) const
+{
+	if (empty() || match_all_) {
+		return true;
+	}
+	std::string lower = fold(name, strlen(name));
+	if (std::binary_search(exact_.begin(), exact_.end(), lower)) {
+		return true;
+	}
+	for (const std::string &prefix : prefixes_) {
+		if (!lower.compare(0, prefix.size(), prefix)) {
+			return true;
+		}
+	}
+	if (globs_.empty()) {
+		return false;
+	}
+	std::vector<uint64_t> scratch(2 * words_);
+	return match_globs(lower.data(), lower.size(), &scratch[0], &scratch[words_]);
+}
+
+void PatternSet::select(const PackIndex &index, const DirTree *dirs, std::vector<size_t> &out) const
+{
+	if (empty() || match_all_) {
+		for (size_t pos = 0; pos < index.size(); pos++) {
+			out.push_back(pos);
+		}
+		return;
+	}
+
+	// Matches are collected from the ranges of the folded order that can
+	// hold them, so the cost follows the size of the result rather than of
+	// the index; only globs starting with a wildcard look at every entry.
+	// An entry can match several patterns, so the result is sorted and
+	// made unique at the end.
+	size_t first = out.size();
+	const std::vector<uint32_t> &order = index.folded_order();
+	auto add_range = [&](size_t begin, size_t end) {
+		for (size_t k = begin; k < end; k++) {
+			out.push_back(order[k]);
+		}
+	};
+	for (const std::string &name : exact_) {
+		std::pair<size_t, size_t> range = index.folded_range(name.data(), name.size(), true);
+		add_range(range.first, range.second);
+	}
+	for (const std::string &prefix : prefixes_) {
+		if (dirs && is_dir_prefix(prefix)) {
+			// "dir/*" also matches files in subdirectories, so it selects
+			// the directory's whole range.
+			int n = dirs->find(prefix.data(), prefix.size() - 1);
+			if (n >= 0) {
+				add_range(dirs->at(n).begin, dirs->at(n).end);
+			}
+		} else {
+			std::pair<size_t, size_t> range = index.folded_range(prefix.data(), prefix.size(), false);
+			add_range(range.first, range.second);
+		}
+	}
+
+	if (!globs_.empty()) {
+		std::vector<uint64_t> scratch(2 * words_);
+		auto try_globs = [&](size_t pos) {
+			if (match_globs(index.lower_name(pos), index.at(pos).first.size(), &scratch[0], &scratch[words_])) {
+				out.push_back(pos);
+			}
+		};
+		if (glob_prefixes_.empty()) {
+			for (size_t pos = 0; pos < index.size(); pos++) {
+				try_globs(pos);
+			}
+		} else {
+			for (const std::string &prefix : glob_prefixes_) {
+				std::pair<size_t, size_t> range = index.folded_range(prefix.data(), prefix.size(), false);
+				for (size_t k = range.first; k < range.second; k++) {
+					try_globs(order[k]);
+				}
+			}
+		}
+	}
+
+	std::sort(out.begin() + first, out.end());
+	out.erase(std::unique(out.begin() + first, out.end()), out.end());
+}
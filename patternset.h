@@ -0,0 +1,66 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+#pragma once
+
+// A set of wildcard patterns ('*' and '?', case insensitive) compiled for
+// selecting pack entries. Selects the same names as trying
+// wc_match_nocase() with every pattern, without doing that per entry:
+// - names without wildcards are looked up in the index's lowercase order,
+// - "prefix*" patterns select a range of it; "dir/*" patterns select a
+//   directory's range from a DirTree when one is given,
+// - all other patterns run together as one bit-parallel automaton, only
+//   over the ranges of their literal prefixes when all of them have one.
+// An empty set matches everything.
+class PatternSet
+{
+public:
+	PatternSet();
+
+	// Building: add patterns, then call finish() once.
+	void add(const char *pattern);
+	// Adds `name' as an exact path; wildcard characters in it are literal.
+	void add_exact(const char *name, size_t len);
+	// Adds every non-empty line of the file at `path' with add_exact().
+	// The set is not empty afterwards even if the file has no such line,
+	// so an empty list selects nothing rather than everything.
+	// Returns <0 on error and errno is set appropriately.
+	int add_list(const char *path);
+	void finish();
+
+	bool empty() const { return exact_.empty() && prefixes_.empty() && globs_.empty() && !match_all_ && !has_list_; }
+	// Whether there are "dir/*" patterns, which select() looks up in a DirTree.
+	bool has_dir_prefixes() const { return has_dir_prefixes_; }
+	// Whether `name' matches any pattern.
+	bool match(const char *name) const;
+	// Appends the positions of the entries of `index' that match, in index
+	// order. Unless the set is empty, `index' must be folded. `dirs' is the
+	// DirTree of `index', or nullptr.
+	void select(const PackIndex &index, const DirTree *dirs, std::vector<size_t> &out) const;
+
+private:
+	// `cur' and `next' are scratch space of words_ words.
+	bool match_globs(const char *lower, size_t len, uint64_t *cur, uint64_t *next) const;
+
+private:
+	bool match_all_;
+	bool has_dir_prefixes_;
+	// Set by add_list().
+	bool has_list_;
+	// All lowercase. Exact names are sorted once finished.
+	std::vector<std::string> exact_;
+	std::vector<std::string> prefixes_;
+	std::vector<std::string> globs_;
+	// Literal prefixes of globs_, sorted and unique; empty if a glob starts
+	// with a wildcard, in which case all names are run through the automaton.
+	std::vector<std::string> glob_prefixes_;
+
+	// The automaton has one bit per pattern position, the patterns'
+	// positions laid out back to back: bit i set means the first i tokens
+	// of a pattern have matched. Arrays are words_ words long; char_mask_
+	// has one array per byte value.
+	size_t words_;
+	std::vector<uint64_t> char_mask_;
+	std::vector<uint64_t> star_mask_;
+	std::vector<uint64_t> start_;
+	std::vector<uint64_t> accept_;
+};
@@ -0,0 +1,231 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+
+// Checks mt_keystream against the reference mt19937ar generator.
+// The kernel is picked once per process, so `make test' runs this once for
+// every MABIPACK_KEYSTREAM_KERNEL value.
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#include "../mt19937ar.h"
+#include "../keystream.h"
+
+
+static int g_failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		g_failures++; \
+	} \
+} while (0)
+
+static const uint32_t SEEDS[] = { 0, 1, 5489, 0xa9c36de1, 0xdeadbeef, 0xffffffff };
+// Odd sizes so that reads straddle block boundaries at every offset.
+static const size_t CHUNKS[] = { 1, 3, 7, 64, 127, 623, 624, 625, 1000, 1247, 1249, 4099 };
+static const size_t STREAM_LEN = 5 * mt_keystream::N * 7 + 13;
+
+static std::vector<uint8_t> reference_bytes(uint32_t seed, size_t len)
+{
+	mt19937ar mt(seed);
+	std::vector<uint8_t> out(len);
+	for (size_t i = 0; i < len; i++) {
+		out[i] = mt.genrand_int32() & 0xff;
+	}
+	return out;
+}
+
+// The forced kernel is only used if the cpu supports it.
+static void check_kernel()
+{
+	const char *want = getenv("MABIPACK_KEYSTREAM_KERNEL");
+	printf("kernel: %s\n", mt_keystream::kernel_name());
+	if (!want) {
+		return;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if ((!strcmp(want, "sse2") && !__builtin_cpu_supports("sse2"))
+		|| (!strcmp(want, "avx2") && !__builtin_cpu_supports("avx2"))) {
+		printf("(%s is not supported by this cpu)\n", want);
+		return;
+	}
+#else
+	if (strcmp(want, "scalar") != 0) {
+		return;
+	}
+#endif
+	CHECK(!strcmp(want, mt_keystream::kernel_name()), "asked for %s, got %s", want, mt_keystream::kernel_name());
+}
+
+static void test_words()
+{
+	for (uint32_t seed : SEEDS) {
+		mt19937ar mt(seed);
+		mt_keystream ks(seed);
+		uint32_t block[mt_keystream::N];
+		for (int b = 0; b < 4; b++) {
+			ks.next_block(block);
+			for (int i = 0; i < mt_keystream::N; i++) {
+				uint32_t want = mt.genrand_int32();
+				CHECK(block[i] == want, "seed %u block %d word %d: %08x != %08x", seed, b, i, block[i], want);
+				if (block[i] != want) {
+					return;
+				}
+			}
+		}
+	}
+}
+
+static void test_bytes()
+{
+	for (uint32_t seed : SEEDS) {
+		std::vector<uint8_t> want = reference_bytes(seed, STREAM_LEN);
+
+		uint8_t block[mt_keystream::N];
+		mt_keystream blocks(seed);
+		for (size_t off = 0; off + mt_keystream::N <= STREAM_LEN; off += mt_keystream::N) {
+			blocks.next_block_bytes(block);
+			CHECK(!memcmp(block, &want[off], mt_keystream::N), "seed %u: next_block_bytes differs at %zu", seed, off);
+		}
+
+		for (size_t chunk : CHUNKS) {
+			mt_keystream ks(seed);
+			std::vector<uint8_t> got(STREAM_LEN);
+			for (size_t off = 0; off < STREAM_LEN; off += chunk) {
+				ks.keystream_bytes(&got[off], std::min(chunk, STREAM_LEN - off));
+			}
+			CHECK(got == want, "seed %u: keystream_bytes in chunks of %zu differs", seed, chunk);
+
+			// xor_bytes over a patterned buffer
+			mt_keystream xs(seed);
+			std::vector<char> buf(STREAM_LEN);
+			for (size_t i = 0; i < STREAM_LEN; i++) {
+				buf[i] = (char)(i * 31 + 7);
+			}
+			for (size_t off = 0; off < STREAM_LEN; off += chunk) {
+				xs.xor_bytes(&buf[off], std::min(chunk, STREAM_LEN - off));
+			}
+			bool same = true;
+			for (size_t i = 0; i < STREAM_LEN && same; i++) {
+				same = (uint8_t)buf[i] == (uint8_t)((uint8_t)(i * 31 + 7) ^ want[i]);
+			}
+			CHECK(same, "seed %u: xor_bytes in chunks of %zu differs", seed, chunk);
+		}
+	}
+}
+
+static void test_discard()
+{
+	static const size_t SKIPS[] = { 0, 1, 623, 624, 625, 1248, 1249, 3000, 6240 };
+	for (uint32_t seed : SEEDS) {
+		std::vector<uint8_t> want = reference_bytes(seed, STREAM_LEN + 10000);
+		for (size_t head : CHUNKS) {
+			for (size_t skip : SKIPS) {
+				mt_keystream ks(seed);
+				std::vector<uint8_t> got(head + 700);
+				ks.keystream_bytes(&got[0], head);
+				ks.discard(skip);
+				ks.keystream_bytes(&got[head], 700);
+				bool same = !memcmp(&got[0], &want[0], head) && !memcmp(&got[head], &want[head + skip], 700);
+				CHECK(same, "seed %u: discard(%zu) after %zu bytes differs", seed, skip, head);
+			}
+		}
+	}
+}
+
+static void test_xor()
+{
+	// keystream_xor() against a plain loop, for every length and alignment
+	// around the vector widths.
+	std::vector<uint8_t> src(300), key(300), dst(300);
+	for (size_t i = 0; i < src.size(); i++) {
+		src[i] = (uint8_t)(i * 13 + 1);
+		key[i] = (uint8_t)(i * 151 + 3);
+	}
+	for (size_t off = 0; off < 33; off++) {
+		for (size_t len = 0; len + off <= 260; len++) {
+			std::fill(dst.begin(), dst.end(), 0xaa);
+			keystream_xor(&dst[off], &src[off], &key[off], len);
+			bool same = true;
+			for (size_t i = 0; i < dst.size() && same; i++) {
+				uint8_t want = (i >= off && i < off + len) ? (src[i] ^ key[i]) : 0xaa;
+				same = dst[i] == want;
+			}
+			CHECK(same, "keystream_xor at offset %zu, length %zu differs", off, len);
+		}
+	}
+}
+
+// keystream_xor_parallel() against one sequential generator. It only
+// splits work when every thread gets at least 1 MiB, so lengths are taken
+// around multiples of that and around the block-aligned slice boundaries.
+static void test_parallel()
+{
+	static const size_t MIB = 1024 * 1024;
+	static const int MAX_THREADS = 8;
+	const size_t N = mt_keystream::N;
+
+	std::set<size_t> lengths = { 0, 1, N - 1, N, N + 1, 7 * N + 1 };
+	for (size_t t = 1; t <= MAX_THREADS; t++) {
+		size_t base = t * MIB;
+		size_t aligned = (base + t * N - 1) / (t * N) * (t * N);
+		for (size_t len : { base - 1, base, base + 1, aligned - 1, aligned, aligned + 1, aligned + N + 1 }) {
+			lengths.insert(len);
+		}
+	}
+
+	const uint32_t seed = 0x12345678;
+	size_t max_len = *lengths.rbegin();
+	std::vector<uint8_t> key(max_len);
+	mt_keystream ks(seed);
+	ks.keystream_bytes(key.data(), max_len);
+
+	std::vector<char> buf(max_len);
+	for (size_t len : lengths) {
+		size_t t0 = std::max<size_t>(1, len / MIB);
+		std::set<int> threads = { 1, (int)t0, (int)t0 + 1, MAX_THREADS };
+		if (t0 > 1) {
+			threads.insert(t0 - 1);
+		}
+		for (int nthreads : threads) {
+			for (size_t i = 0; i < len; i++) {
+				buf[i] = (char)(i * 7);
+			}
+			keystream_xor_parallel(seed, buf.data(), len, nthreads);
+			bool same = true;
+			for (size_t i = 0; i < len && same; i++) {
+				same = (uint8_t)buf[i] == (uint8_t)((uint8_t)(i * 7) ^ key[i]);
+			}
+			CHECK(same, "keystream_xor_parallel(%zu bytes, %d threads) differs", len, nthreads);
+		}
+	}
+}
+
+int main()
+{
+	check_kernel();
+	test_words();
+	test_bytes();
+	test_discard();
+	test_xor();
+	test_parallel();
+	if (g_failures) {
+		fprintf(stderr, "%d check(s) failed\n", g_failures);
+		return EXIT_FAILURE;
+	}
+	printf("keystream_test: OK\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,269 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+
+// Many threads reading one pack at once. Writes a small pack to a temporary
+// directory, then opens it in every mode and has readers race each other,
+// including against the first find() of a lazily opened pack and the first
+// folded_files()/dir_tree() calls, checking every decoded file.
+
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cctype>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../mabipack.h"
+#include "../contentcache.h"
+
+
+static std::atomic<int> g_failures(0);
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		g_failures++; \
+	} \
+} while (0)
+
+static const int NDIRS = 12;
+// A multiple of NDIRS, so every top level directory holds NFILES / NDIRS files.
+static const int NFILES = 480;
+// Files this large are decoded in chunks and, with parallel decryption
+// set, by several threads.
+static const int NBIG = 2;
+static const size_t BIG_SIZE = 3 * 1048576 + 77;
+static const int NTHREADS = 8;
+static const int ITERATIONS = 400;
+
+static std::string file_name(int i)
+{
+	char name[64];
+	// Mixed case, so that folded lookups and the directory tree see
+	// names that differ from their lowercase form.
+	snprintf(name, sizeof (name), "Dir%d/sub%d/File%d.txt", i % NDIRS, i % 3, i);
+	return name;
+}
+
+static size_t file_size(int i)
+{
+	if (i < NBIG) {
+		return BIG_SIZE;
+	}
+	return (i * 977) % 9000;
+}
+
+static std::string file_contents(int i)
+{
+	std::string data(file_size(i), '\0');
+	uint32_t x = i * 2654435761u + 1;
+	for (size_t k = 0; k < data.size(); k++) {
+		// Half text, half noise, so that both compress differently.
+		x = x * 1103515245 + 12345;
+		data[k] = (k & 64) ? (char)(x >> 16) : (char)('a' + k % 26);
+	}
+	return data;
+}
+
+static int write_file(const std::string &path, const std::string &data)
+{
+	for (size_t pos = path.find('/'); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+		if (mkdir(path.substr(0, pos).c_str(), 0755) < 0 && errno != EEXIST) {
+			return -1;
+		}
+	}
+	FILE *fp = fopen(path.c_str(), "wb");
+	if (!fp) {
+		return -1;
+	}
+	bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+	return (fclose(fp) == 0 && ok) ? 0 : -1;
+}
+
+static int create_pack(const std::string &packpath)
+{
+	MabiPackWriter writer;
+	if (writer.open(packpath, 1, NFILES) < 0) {
+		return -1;
+	}
+	for (int i = 0; i < NFILES; i++) {
+		std::string name = file_name(i);
+		if (write_file(name, file_contents(i)) < 0 || writer.addfile(name) < 0) {
+			writer.discard();
+			return -1;
+		}
+		unlink(name.c_str());
+	}
+	return writer.commit();
+}
+
+// One reader. Each thread mixes every lookup and read function, starting
+// at a different point so that the first calls on a fresh pack collide.
+static void reader(const MabiPack &pack, const std::vector<std::string> &expected, int id)
+{
+	uint32_t x = id * 7919 + 1;
+	for (int iter = 0; iter < ITERATIONS; iter++) {
+		x = x * 1103515245 + 12345;
+		int i = (x >> 8) % NFILES;
+		std::string name = file_name(i);
+		const std::string &want = expected[i];
+
+		switch ((iter + id) % 6) {
+		case 0: {
+			file_info entry;
+			bool found = pack.lookup(name, entry);
+			CHECK(found && entry.size_orig == want.size(), "lookup(%s)", name.c_str());
+			MabiPack::buffer_t data = pack.readfile(name);
+			CHECK(data && !memcmp(data.get(), want.data(), want.size()), "readfile(%s)", name.c_str());
+			break;
+		}
+		case 1: {
+			const file_info *entry = pack.find(name);
+			CHECK(entry && entry->size_orig == want.size(), "find(%s)", name.c_str());
+			if (entry) {
+				std::vector<char> out(want.size() + 1);
+				int ret = pack.readfile(*entry, out.data(), out.size());
+				CHECK(ret >= 0 && !memcmp(out.data(), want.data(), want.size()), "readfile(%s, buffer)", name.c_str());
+			}
+			break;
+		}
+		case 2: {
+			const file_info *entry = pack.find(name);
+			if (!entry) {
+				CHECK(false, "find(%s)", name.c_str());
+				break;
+			}
+			std::string got;
+			int ret = pack.readfile(*entry, [&got](const char *data, size_t len) {
+				got.append(data, len);
+				return 0;
+			});
+			CHECK(ret >= 0 && got == want, "readfile(%s, sink)", name.c_str());
+			break;
+		}
+		case 3: {
+			const file_info *entry = pack.find(name);
+			if (!entry) {
+				CHECK(false, "find(%s)", name.c_str());
+				break;
+			}
+			MabiPack::content_ptr data = pack.read_cached(*entry);
+			CHECK(data && data->size() == want.size() && !memcmp(data->data(), want.data(), want.size()),
+				"read_cached(%s)", name.c_str());
+			break;
+		}
+		case 4: {
+			const PackIndex &folded = pack.folded_files();
+			CHECK(folded.size() == (size_t)NFILES, "folded_files() has %zu entries", folded.size());
+			std::string lower = name;
+			for (char &c : lower) {
+				c = tolower((unsigned char)c);
+			}
+			std::pair<size_t, size_t> range = folded.folded_range(lower.data(), lower.size(), true);
+			CHECK(range.second - range.first == 1, "folded_range(%s)", lower.c_str());
+			break;
+		}
+		case 5: {
+			const DirTree &tree = pack.dir_tree();
+			std::string dir = name.substr(0, name.find('/'));
+			int n = tree.find(dir.data(), dir.size());
+			CHECK(n > 0, "dir_tree().find(%s)", dir.c_str());
+			if (n > 0) {
+				const DirTree::dir &d = tree.at(n);
+				CHECK(d.end - d.begin == (uint32_t)(NFILES / NDIRS),
+					"%s has %u entries", dir.c_str(), d.end - d.begin);
+			}
+			break;
+		}
+		}
+	}
+}
+
+static void stress(const std::string &packpath, const std::vector<std::string> &expected, int flags, bool parallel_decrypt)
+{
+	ContentCache cache(16 * 1048576);
+	MabiPack pack;
+	int ret = pack.openpack(packpath, flags);
+	CHECK(ret >= 0, "openpack(flags %#x): %d", flags, ret);
+	if (ret < 0) {
+		return;
+	}
+	pack.set_content_cache(&cache);
+	if (parallel_decrypt) {
+		pack.set_parallel_decrypt(4, 1048576);
+	}
+
+	std::vector<std::thread> threads;
+	for (int id = 0; id < NTHREADS; id++) {
+		threads.emplace_back(reader, std::cref(pack), std::cref(expected), id);
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	pack.closepack();
+}
+
+int main()
+{
+	char dir[] = "/tmp/mabipack_stress.XXXXXX";
+	if (!mkdtemp(dir) || chdir(dir) < 0) {
+		perror(dir);
+		return EXIT_FAILURE;
+	}
+
+	std::vector<std::string> expected(NFILES);
+	for (int i = 0; i < NFILES; i++) {
+		expected[i] = file_contents(i);
+	}
+	std::string packpath = std::string(dir) + "/stress.pack";
+	if (create_pack(packpath) < 0) {
+		perror("create_pack");
+		return EXIT_FAILURE;
+	}
+
+	static const int MODES[] = {
+		0,
+		MABIPACK_OPEN_MMAP,
+		MABIPACK_OPEN_LAZY,
+		MABIPACK_OPEN_LAZY | MABIPACK_OPEN_MMAP,
+	};
+	for (int flags : MODES) {
+		stress(packpath, expected, flags, false);
+		stress(packpath, expected, flags, true);
+	}
+
+	unlink(packpath.c_str());
+	for (int d = 0; d < NDIRS; d++) {
+		for (int s = 0; s < 3; s++) {
+			char sub[64];
+			snprintf(sub, sizeof (sub), "%s/Dir%d/sub%d", dir, d, s);
+			rmdir(sub);
+		}
+		char top[64];
+		snprintf(top, sizeof (top), "%s/Dir%d", dir, d);
+		rmdir(top);
+	}
+	rmdir(dir);
+
+	if (g_failures) {
+		fprintf(stderr, "%d check(s) failed\n", g_failures.load());
+		return EXIT_FAILURE;
+	}
+	printf("pack_stress_test: OK\n");
+	return EXIT_SUCCESS;
+}
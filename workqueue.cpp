@@ -0,0 +1,84 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include <cstddef>
+
+#include "workqueue.h"
+
+
+size_t run_ordered(size_t count, int nthreads, size_t window,
+	const std::function<int(size_t)> &job, const std::function<bool(size_t, int)> &done)
+{
+	if (nthreads <= 1) {
+		for (size_t i = 0; i < count; i++) {
+			if (!done(i, job(i))) {
+				return i + 1;
+			}
+		}
+		return count;
+	}
+	if (window < (size_t)nthreads) {
+		window = nthreads;
+	}
+
+	std::mutex lock;
+	std::condition_variable job_cv, done_cv;
+	std::vector<int> results(count);
+	std::vector<char> finished(count, 0);
+	size_t next_job = 0, next_done = 0;
+	bool stop = false;
+
+	auto worker = [&]() {
+		std::unique_lock<std::mutex> guard(lock);
+		for (;;) {
+			while (!stop && next_job < count && next_job >= next_done + window) {
+				job_cv.wait(guard);
+			}
+			if (stop || next_job >= count) {
+				break;
+			}
+			size_t i = next_job++;
+			guard.unlock();
+			int ret = job(i);
+			guard.lock();
+			results[i] = ret;
+			finished[i] = 1;
+			done_cv.notify_one();
+		}
+	};
+	std::vector<std::thread> workers;
+	for (int i = 0; i < nthreads; i++) {
+		workers.push_back(std::thread(worker));
+	}
+
+	size_t ndone = 0;
+	std::unique_lock<std::mutex> guard(lock);
+	while (ndone < count) {
+		while (!finished[ndone]) {
+			done_cv.wait(guard);
+		}
+		int ret = results[ndone];
+		guard.unlock();
+		bool cont = done(ndone, ret);
+		guard.lock();
+		ndone++;
+		next_done = ndone;
+		job_cv.notify_all();
+		if (!cont) {
+			stop = true;
+			break;
+		}
+	}
+	guard.unlock();
+
+	for (std::thread &t : workers) {
+		t.join();
+	}
+	return ndone;
+}
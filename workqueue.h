@@ -0,0 +1,14 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+#pragma once
+
+// Runs job(i) for every i in [0, count) on `nthreads' worker threads and
+// passes each result to done(i, ret) on the calling thread, in index order.
+// At most `window' jobs are started ahead of the last done() call, which
+// bounds the memory held by finished but not yet consumed jobs.
+// Once done() returns false no more jobs are started; jobs already running
+// are waited for but their results are dropped.
+// Returns the number of jobs passed to done().
+// With nthreads <= 1 everything runs on the calling thread.
+size_t run_ordered(size_t count, int nthreads, size_t window,
+	const std::function<int(size_t)> &job, const std::function<bool(size_t, int)> &done);
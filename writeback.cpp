@@ -0,0 +1,481 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "writeback.h"
+
+
+// Files that are open, being written or being closed at once through io_uring.
+// Each has at most one operation queued, so the rings never overflow.
+static const unsigned URING_MAX_FILES = 64;
+static const unsigned URING_ENTRIES = 2 * URING_MAX_FILES;
+// Largest single write; longer buffers are written in several steps.
+static const size_t URING_MAX_WRITE = 1 << 30;
+
+enum
+{
+	STEP_OPEN,
+	STEP_WRITE,
+	STEP_CLOSE,
+};
+
+// A raw io_uring instance, set up without liburing.
+struct WriteBack::uring
+{
+	int fd;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	io_uring_sqe *sqes;
+	size_t sqes_size;
+	io_uring_cqe *cqes;
+	unsigned to_submit;
+
+	uring()
+		: fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes((io_uring_sqe *)MAP_FAILED), to_submit(0)
+	{
+	}
+
+	~uring()
+	{
+		if (sqes != MAP_FAILED) {
+			::munmap(sqes, sqes_size);
+		}
+		if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+			::munmap(cq_ptr, cq_size);
+		}
+		if (sq_ptr != MAP_FAILED) {
+			::munmap(sq_ptr, sq_size);
+		}
+		if (fd >= 0) {
+			::close(fd);
+		}
+	}
+
+	// Returns <0 if io_uring or one of the operations we need is unavailable.
+	int setup(unsigned entries)
+	{
+		io_uring_params p;
+		std::memset(&p, 0, sizeof (p));
+		fd = ::syscall(__NR_io_uring_setup, entries, &p);
+		if (fd < 0) {
+			return -1;
+		}
+
+		sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+		cq_size = p.cq_off.cqes + p.cq_entries * sizeof (io_uring_cqe);
+		bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+		if (single_mmap) {
+			sq_size = cq_size = std::max(sq_size, cq_size);
+		}
+		sq_ptr = ::mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (sq_ptr == MAP_FAILED) {
+			return -2;
+		}
+		if (single_mmap) {
+			cq_ptr = sq_ptr;
+		} else {
+			cq_ptr = ::mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+			if (cq_ptr == MAP_FAILED) {
+				return -2;
+			}
+		}
+		sqes_size = p.sq_entries * sizeof (io_uring_sqe);
+		sqes = (io_uring_sqe *)::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED) {
+			return -2;
+		}
+
+		char *sq = (char *)sq_ptr, *cq = (char *)cq_ptr;
+		sq_head = (unsigned *)(sq + p.sq_off.head);
+		sq_tail = (unsigned *)(sq + p.sq_off.tail);
+		sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+		sq_array = (unsigned *)(sq + p.sq_off.array);
+		cq_head = (unsigned *)(cq + p.cq_off.head);
+		cq_tail = (unsigned *)(cq + p.cq_off.tail);
+		cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+		cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+		// openat, write and close through io_uring appeared in Linux 5.6.
+		size_t probe_size = sizeof (io_uring_probe) + 256 * sizeof (io_uring_probe_op);
+		std::vector<char> probe_buf(probe_size, 0);
+		io_uring_probe *probe = (io_uring_probe *)probe_buf.data();
+		if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+			return -3;
+		}
+		for (int op : {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE}) {
+			if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+				return -3;
+			}
+		}
+		return 0;
+	}
+
+	io_uring_sqe *get_sqe(uint8_t opcode, void *user_data)
+	{
+		unsigned tail = *sq_tail;
+		unsigned index = tail & *sq_mask;
+		io_uring_sqe *sqe = &sqes[index];
+		std::memset(sqe, 0, sizeof (*sqe));
+		sqe->opcode = opcode;
+		sqe->user_data = (uint64_t)(uintptr_t)user_data;
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		to_submit++;
+		return sqe;
+	}
+
+	// Submits queued operations and waits for at least `wait' completions.
+	int enter(unsigned wait)
+	{
+		for (;;) {
+			int ret = ::syscall(__NR_io_uring_enter, fd, to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+			if (ret >= 0) {
+				to_submit -= ret;
+				return 0;
+			}
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				return -1;
+			}
+			if (errno != EINTR) {
+				// Completions must be reaped first.
+				return 0;
+			}
+		}
+	}
+};
+
+
+WriteBack::WriteBack()
+	: flags_(0)
+	, mode_(0)
+	, max_inflight_(0)
+	, inflight_(0)
+	, stopping_(false)
+{
+}
+
+WriteBack::~WriteBack()
+{
+	finish();
+}
+
+int WriteBack::start(int flags, mode_t mode, size_t max_inflight, int nthreads, const done_t &done)
+{
+	flags_ = flags | O_CLOEXEC;
+	mode_ = mode;
+	max_inflight_ = max_inflight;
+	done_ = done;
+	stopping_ = false;
+
+	const char *force = getenv("MABIPACK_WRITEBACK");
+	if (!force || strcmp(force, "threads")) {
+		std::unique_ptr<uring> ring(new uring);
+		if (ring->setup(URING_ENTRIES) == 0) {
+			ring_ = std::move(ring);
+			threads_.emplace_back(&WriteBack::uring_worker, this);
+			return 0;
+		}
+	}
+
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+	for (int i = 0; i < nthreads; i++) {
+		threads_.emplace_back(&WriteBack::thread_worker, this);
+	}
+	return 0;
+}
+
+void WriteBack::submit(int dirfd, const char *name, char *data, size_t len, int64_t mtime, uint64_t token)
+{
+	request *req = new request;
+	req->dirfd = dirfd;
+	req->name = name;
+	req->data = data;
+	req->len = len;
+	req->mtime = mtime;
+	req->token = token;
+	req->cost = sizeof (request) + req->name.size() + len;
+	req->fd = -1;
+	req->written = 0;
+	req->step = STEP_OPEN;
+	req->err = 0;
+
+	std::unique_lock<std::mutex> guard(lock_);
+	// A file larger than the limit is let through alone.
+	while (inflight_ > 0 && inflight_ + req->cost > max_inflight_) {
+		space_cv_.wait(guard);
+	}
+	inflight_ += req->cost;
+	queue_.push_back(req);
+	queue_cv_.notify_one();
+}
+
+void WriteBack::finish()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		stopping_ = true;
+		queue_cv_.notify_all();
+	}
+	for (std::thread &thread : threads_) {
+		thread.join();
+	}
+	threads_.clear();
+	ring_.reset();
+}
+
+const char *WriteBack::backend_name() const
+{
+	return ring_ ? "io_uring" : "threads";
+}
+
+void WriteBack::complete(request *req, int err)
+{
+	done_(req->token, err ? -1 : 0, err);
+
+	std::lock_guard<std::mutex> guard(lock_);
+	inflight_ -= req->cost;
+	delete[] req->data;
+	delete req;
+	space_cv_.notify_all();
+}
+
+void WriteBack::thread_worker()
+{
+	for (;;) {
+		request *req;
+		{
+			std::unique_lock<std::mutex> guard(lock_);
+			while (queue_.empty() && !stopping_) {
+				queue_cv_.wait(guard);
+			}
+			if (queue_.empty()) {
+				return;
+			}
+			req = queue_.front();
+			queue_.pop_front();
+		}
+
+		int err = 0;
+		int fd = ::openat(req->dirfd, req->name.c_str(), flags_, mode_);
+		if (fd < 0) {
+			complete(req, errno);
+			continue;
+		}
+		size_t done = 0;
+		while (done < req->len) {
+			ssize_t nwrite = ::write(fd, req->data + done, req->len - done);
+			if (nwrite < 0 && errno == EINTR) {
+				continue;
+			}
+			if (nwrite <= 0) {
+				err = nwrite < 0 ? errno : EIO;
+				break;
+			}
+			done += nwrite;
+		}
+		if (!err && req->mtime != -1) {
+			struct timespec times[2] = { { 0, UTIME_OMIT }, { (time_t)req->mtime, 0 } };
+			if (::futimens(fd, times) < 0) {
+				err = errno;
+			}
+		}
+		if (::close(fd) < 0 && !err) {
+			err = errno;
+		}
+		if (err) {
+			::unlinkat(req->dirfd, req->name.c_str(), 0);
+		}
+		complete(req, err);
+	}
+}
+
+void WriteBack::uring_worker()
+{
+	// Requests with an operation in the ring.
+	std::set<request *> active;
+	for (;;) {
+		std::vector<request *> fresh;
+		{
+			std::unique_lock<std::mutex> guard(lock_);
+			while (queue_.empty() && active.empty() && !stopping_) {
+				queue_cv_.wait(guard);
+			}
+			if (queue_.empty() && active.empty()) {
+				return;
+			}
+			while (!queue_.empty() && active.size() + fresh.size() < URING_MAX_FILES) {
+				fresh.push_back(queue_.front());
+				queue_.pop_front();
+			}
+		}
+		for (request *req : fresh) {
+			io_uring_sqe *sqe = ring_->get_sqe(IORING_OP_OPENAT, req);
+			sqe->fd = req->dirfd;
+			sqe->addr = (uint64_t)(uintptr_t)req->name.c_str();
+			sqe->len = mode_;
+			sqe->open_flags = flags_;
+			active.insert(req);
+		}
+
+		if (ring_->enter(1) < 0) {
+			int err = errno;
+			fprintf(stderr, "io_uring_enter: %s; writing files with a thread instead\n", strerror(err));
+			uring_fail(active, err);
+			thread_worker();
+			return;
+		}
+
+		unsigned head = *ring_->cq_head;
+		unsigned tail = __atomic_load_n(ring_->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			io_uring_cqe *cqe = &ring_->cqes[head & *ring_->cq_mask];
+			request *req = (request *)(uintptr_t)cqe->user_data;
+			if (uring_advance(req, cqe->res)) {
+				active.erase(req);
+			}
+		}
+		__atomic_store_n(ring_->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+void WriteBack::uring_fail(std::set<request *> &active, int err)
+{
+	uring &ring = *ring_;
+
+	// Operations the kernel has not taken yet are taken back.
+	unsigned tail = *ring.sq_tail;
+	unsigned first = tail - ring.to_submit;
+	for (unsigned i = first; i != tail; i++) {
+		request *req = (request *)(uintptr_t)ring.sqes[i & *ring.sq_mask].user_data;
+		uring_abort(req, err);
+		active.erase(req);
+	}
+	__atomic_store_n(ring.sq_tail, first, __ATOMIC_RELEASE);
+	ring.to_submit = 0;
+
+	// The others use their request's buffers until they complete.
+	while (!active.empty()) {
+		if (ring.enter(1) < 0) {
+			// They may never complete, so their buffers cannot be freed:
+			// the requests are failed but leaked.
+			int enter_err = errno;
+			for (request *req : active) {
+				done_(req->token, -1, enter_err);
+				std::lock_guard<std::mutex> guard(lock_);
+				inflight_ -= req->cost;
+				space_cv_.notify_all();
+			}
+			active.clear();
+			return;
+		}
+		unsigned head = *ring.cq_head;
+		unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != cq_tail; head++) {
+			io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			request *req = (request *)(uintptr_t)cqe->user_data;
+			if (req->step == STEP_OPEN && cqe->res >= 0) {
+				req->fd = cqe->res;
+			} else if (req->step == STEP_CLOSE) {
+				req->fd = -1;
+			}
+			uring_abort(req, err);
+			active.erase(req);
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+void WriteBack::uring_abort(request *req, int err)
+{
+	bool created = req->fd >= 0 || req->step != STEP_OPEN;
+	if (req->fd >= 0) {
+		::close(req->fd);
+	}
+	if (created) {
+		::unlinkat(req->dirfd, req->name.c_str(), 0);
+	}
+	complete(req, err);
+}
+
+bool WriteBack::uring_advance(request *req, int res)
+{
+	switch (req->step) {
+	case STEP_OPEN:
+		if (res < 0) {
+			complete(req, -res);
+			return true;
+		}
+		req->fd = res;
+		req->step = req->len > 0 ? STEP_WRITE : STEP_CLOSE;
+		break;
+
+	case STEP_WRITE:
+		if (res <= 0) {
+			req->err = res < 0 ? -res : EIO;
+			req->step = STEP_CLOSE;
+		} else {
+			req->written += res;
+			if (req->written == req->len) {
+				req->step = STEP_CLOSE;
+			}
+		}
+		break;
+
+	case STEP_CLOSE:
+		if (res < 0 && !req->err) {
+			req->err = -res;
+		}
+		if (!req->err && req->mtime != -1) {
+			// io_uring has no operation for this.
+			struct timespec times[2] = { { 0, UTIME_OMIT }, { (time_t)req->mtime, 0 } };
+			if (::utimensat(req->dirfd, req->name.c_str(), times, 0) < 0) {
+				req->err = errno;
+			}
+		}
+		if (req->err) {
+			::unlinkat(req->dirfd, req->name.c_str(), 0);
+		}
+		complete(req, req->err);
+		return true;
+	}
+
+	if (req->step == STEP_WRITE) {
+		io_uring_sqe *sqe = ring_->get_sqe(IORING_OP_WRITE, req);
+		sqe->fd = req->fd;
+		sqe->addr = (uint64_t)(uintptr_t)(req->data + req->written);
+		sqe->len = std::min(req->len - req->written, URING_MAX_WRITE);
+		sqe->off = req->written;
+	} else {
+		io_uring_sqe *sqe = ring_->get_sqe(IORING_OP_CLOSE, req);
+		sqe->fd = req->fd;
+	}
+	return false;
+}
@@ -0,0 +1,83 @@
+// Copyright (c) 2013 Park Jeongmin (pjm0616@gmail.com)
+// See LICENSE for details.
+#pragma once
+
+// Writes whole files in the background.
+// Callers hand over a decoded buffer and go on with the next file while the
+// buffer is written out. With io_uring the open, write and close steps of
+// many files are batched into few system calls; when io_uring is not
+// available (or MABIPACK_WRITEBACK=threads is set) a pool of writer threads
+// does plain blocking I/O instead.
+// A file that cannot be written completely is closed and unlinked.
+class WriteBack
+{
+public:
+	// Called on a backend thread once a file is done: ret is 0 on success,
+	// or <0 with the errno value in `err'.
+	typedef std::function<void(uint64_t token, int ret, int err)> done_t;
+
+public:
+	WriteBack();
+	~WriteBack();
+
+	// Files are opened with `flags' and `mode'. At most `max_inflight' bytes
+	// of file data are queued or being written at a time; `nthreads' is the
+	// number of writer threads used without io_uring.
+	// Returns <0 on error.
+	int start(int flags, mode_t mode, size_t max_inflight, int nthreads, const done_t &done);
+	// Queues `len' bytes at `data' to be written to `name' relative to
+	// `dirfd', which must stay open until finish(). The buffer is taken over
+	// and freed with delete[]. Unless `mtime' is -1 the file's modification
+	// time is set to it. Blocks while the in-flight limit is reached.
+	void submit(int dirfd, const char *name, char *data, size_t len, int64_t mtime, uint64_t token);
+	// Waits until every queued file is done and stops the backend.
+	void finish();
+
+	// "io_uring" or "threads"
+	const char *backend_name() const;
+
+private:
+	struct request
+	{
+		int dirfd;
+		std::string name;
+		char *data;
+		size_t len;
+		int64_t mtime;
+		uint64_t token;
+		// Counted against the in-flight limit.
+		size_t cost;
+		// io_uring state
+		int fd;
+		size_t written;
+		int step;
+		int err;
+	};
+	struct uring;
+
+	void complete(request *req, int err);
+	void thread_worker();
+	void uring_worker();
+	// Handles the completion of req's current step and queues the next one.
+	// Returns true once the request is done.
+	bool uring_advance(request *req, int res);
+	// Fails the `active' requests, which have operations in the ring, with
+	// `err' after io_uring_enter() failed.
+	void uring_fail(std::set<request *> &active, int err);
+	// Closes and unlinks req's file, if it got that far, and fails it.
+	void uring_abort(request *req, int err);
+
+private:
+	int flags_;
+	mode_t mode_;
+	size_t max_inflight_;
+	done_t done_;
+	std::unique_ptr<uring> ring_;
+	std::vector<std::thread> threads_;
+
+	std::mutex lock_;
+	std::condition_variable queue_cv_, space_cv_;
+	std::deque<request *> queue_;
+	size_t inflight_;
+	bool stopping_;
+};